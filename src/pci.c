@@ -28,15 +28,36 @@
 #include <stdio.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
 #include <sys/stat.h>
 
 #include <pciaccess.h>
 #include <libxo/xo.h>
 
+#include "pci_stats.h"
+
 extern void devlist(int argc, char *argv[]);
 extern void devtree(int argc, char *argv[]);
 extern void get_set(int argc, char *argv[]);
 extern void reg_list(int argc, char *argv[]);
+extern void tune(int argc, char *argv[]);
+extern void aspm(int argc, char *argv[]);
+extern void bars(int argc, char *argv[]);
+
+extern void trace(int argc, char *argv[]);
+extern void bench(int argc, char *argv[]);
+extern void dma_audit(int argc, char *argv[]);
+extern void fingerprint(int argc, char *argv[]);
+extern void fleet(int argc, char *argv[]);
+extern void p2p(int argc, char *argv[]);
+extern void pm(int argc, char *argv[]);
+extern void reset(int argc, char *argv[]);
+extern void vpd(int argc, char *argv[]);
+
+extern int32_t cfg_backend_init(const char *name);
+extern int32_t trace_open(const char *path);
+extern void trace_close(void);
+extern void cfg_backend_fini(void);
 
 typedef void (*pci_fcn_t)(int argc, char *argv[]);
 
@@ -45,11 +66,24 @@ static struct pci_op {
 	pci_fcn_t	fcn;
 	const char	*usage;
 } ops[] = {
-	{"devlist", devlist, "       pci devlist [--libxo <args>] [-n] [-s selector]\n"},
-	{"tree",    devtree, "       pci tree [--libxo <args>] [-n]\n"},
+	{"devlist", devlist, "       pci devlist [--libxo <args>] [-e] [-n] [-t] [-f fields] [-S field] [-s selector]\n"},
+	{"tree",    devtree, "       pci tree [--libxo <args>] [-b] [-e] [-n] [-t] [-f fields] [-d depth] [-a] [-s selector]\n"},
 	{"set",     get_set, "       pci set -s <selector>\n"},
-	{"get",     get_set, "       pci get -s <selector>\n"},
+	{"get",     get_set, "       pci get [-r] -s <selector> <register|start-end|start+len|all>\n"},
 	{"reg",     reg_list,"       pci reg\n"},
+	{"aspm",    aspm,    "       pci aspm [--libxo <args>] [-s selector]\n"},
+	{"bars",    bars,    "       pci bars [--libxo <args>] [-s selector]\n"},
+	{"bench",   bench,   "       pci bench [--libxo <args>] [-i iterations] [-s selector] cfg\n"},
+	{"dma-audit", dma_audit, "       pci dma-audit [--libxo <args>] [-s selector]\n"},
+	{"fingerprint", fingerprint, "       pci fingerprint [--libxo <args>] [-b baseline] [-w file] [-j jobs]\n"},
+	{"fleet",   fleet,   "       pci fleet [--libxo <args>] capture <file>\n"
+			     "       pci fleet [--libxo <args>] [-c fields] [-j jobs] query <dir> [term ...]\n"},
+	{"p2p",     p2p,     "       pci p2p [--libxo <args>] <selector> <selector>\n"},
+	{"pm",      pm,      "       pci pm [--libxo <args>] [-l] [-m] [-s selector]\n"},
+	{"reset",   reset,   "       pci reset [--libxo <args>] [-m flr|sbr|pm] [-j parallel] [-f] -s <selector>\n"},
+	{"trace",   trace,   "       pci trace [--libxo <args>] [-w] <report|replay> <file>\n"},
+	{"vpd",     vpd,     "       pci vpd [--libxo <args>] [-r] [-c cache] [-j jobs] [-s selector]\n"},
+	{"tune",    tune,    "       pci tune [--libxo <args>] [-n] <apply|check> <profile>\n"},
 	{NULL, NULL, NULL}
 };
 
@@ -60,6 +94,7 @@ usage(void)
 
 	p = ops;
 	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "       pci [--backend=pciaccess|ecam|ecam:<file>] [--stats] [--trace=<file>] <command> [options]\n");
 	while (p->name != NULL) {
 		fprintf(stderr, "%s", p->usage);
 		p++;
@@ -70,20 +105,64 @@ int
 main(int argc, char *argv[])
 {
 	char *op = "devlist";
+	const char *backend = NULL;
+	const char *trace_file = NULL;
 	struct pci_op *p = NULL;
 
 	argc = xo_parse_args(argc, argv);
 	if (argc < 0)
 		exit(EXIT_FAILURE);
 
+	/* Global options precede the command name */
+	while ((argc > 1) && (strncmp(argv[1], "--", 2) == 0)) {
+		if (strncmp(argv[1], "--backend=", 10) == 0) {
+			backend = argv[1] + 10;
+		} else if (strcmp(argv[1], "--stats") == 0) {
+			stats_enable();
+		} else if (strncmp(argv[1], "--trace=", 8) == 0) {
+			trace_file = argv[1] + 8;
+		} else {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc > 1) {
 		op = argv[1];
 	}
 
+	stats_begin(STATS_INIT);
+
 	if (pci_system_init()) {
 		err(1, "Couldn't initialize PCI system");
 	}
 
+	errno = cfg_backend_init(backend);
+	if (errno) {
+		err(1, "Couldn't initialize backend %s", backend);
+	}
+
+	stats_end(STATS_INIT);
+
+	if (trace_file != NULL) {
+		struct stat tsb, osb;
+
+		/* Opening the trace truncates it, don't lose the one to analyze */
+		if ((strcmp(op, "trace") == 0) && (argc > 2) &&
+				(stat(trace_file, &tsb) == 0) &&
+				(stat(argv[argc - 1], &osb) == 0) &&
+				(tsb.st_dev == osb.st_dev) && (tsb.st_ino == osb.st_ino)) {
+			errx(1, "Trace file %s is the file being analyzed", trace_file);
+		}
+
+		errno = trace_open(trace_file);
+		if (errno) {
+			err(1, "Couldn't create trace file %s", trace_file);
+		}
+	}
+
 	p = ops;
 	while (p->name != NULL) {
 		if (strcmp(op, p->name) == 0) {
@@ -96,8 +175,14 @@ main(int argc, char *argv[])
 	if (p->name == NULL)
 		usage();
 
+	stats_report();
+
 	xo_finish();
 
+	trace_close();
+
+	cfg_backend_fini();
+
 	pci_system_cleanup();
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,315 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <getopt.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern struct pci_slot_match *parse_selector(const char *s);
+extern void tree_build(void);
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+extern void tree_free(void);
+
+#define NO_LIMIT	UINT64_MAX
+
+/* Switches add up to 1us of L1 exit latency each (PCIe 5.4.1.3) */
+#define SWITCH_L1_NS	1000
+
+static struct option opts[] = {
+	{ "selector", required_argument, NULL, 's'},
+	{ NULL, 0, NULL, 0 }
+};
+
+/*
+ * Convert the LNKCAP / DEVCAP latency encodings to nanoseconds using the
+ * upper bound of each range
+ */
+static uint64_t
+l0s_exit_ns(uint32_t code)
+{
+
+	return 64ULL << code;
+}
+
+static uint64_t
+l1_exit_ns(uint32_t code)
+{
+
+	return 1000ULL << code;
+}
+
+static uint64_t
+l0s_acceptable_ns(uint32_t code)
+{
+
+	return code == 7 ? NO_LIMIT : 64ULL << code;
+}
+
+static uint64_t
+l1_acceptable_ns(uint32_t code)
+{
+
+	return code == 7 ? NO_LIMIT : 1000ULL << code;
+}
+
+static const char *
+aspm_str(uint16_t lnkctl)
+{
+	static const char *aspm[] = { "disabled", "L0s", "L1", "L0s L1" };
+
+	return aspm[lnkctl & (PCIE_LNKCTL_ASPM_L0S | PCIE_LNKCTL_ASPM_L1)];
+}
+
+static void
+emit_ns(const char *name, uint64_t ns)
+{
+	char fmt[64];
+
+	if (ns == NO_LIMIT) {
+		snprintf(fmt, sizeof(fmt), "{:%s/%%s}", name);
+		xo_emit(fmt, "unlimited");
+	} else {
+		snprintf(fmt, sizeof(fmt), "{:%s/%%ju}{U:ns}", name);
+		xo_emit(fmt, (uintmax_t)ns);
+	}
+}
+
+/**
+ * Audit the ASPM exit latency of the path from an endpoint to its root port
+ *
+ * L0s exit latencies of the links with L0s enabled are summed. For L1,
+ * the largest exit latency of the links with L1 enabled (including the
+ * L1.2 power on time where enabled) plus 1us per switch is used. These
+ * are compared to the acceptable latencies in the endpoint's DEVCAP and,
+ * when LTR is enabled, to the maximum snoop latency.
+ */
+static void
+aspm_path(struct pci_device *ep, uint32_t ep_cap)
+{
+	struct pci_device *up = ep, *dp;
+	struct pci_device *l0s_worst = NULL, *l1_worst = NULL;
+	uint64_t l0s_path = 0, l1_path = 0, l1_max = 0;
+	uint64_t l0s_acc, l1_acc, l0s_max = 0;
+	uint32_t devcap = 0, switches = 0;
+	uint32_t l1ss, ltr;
+	uint16_t devctl2 = 0;
+
+	read_cfg(ep, ep_cap + PCIE_DEVCAP, &devcap, 4);
+	read_cfg(ep, ep_cap + PCIE_DEVCTL2, &devctl2, 2);
+
+	l0s_acc = l0s_acceptable_ns(PCIE_DEVCAP_L0S_ACC(devcap));
+	l1_acc = l1_acceptable_ns(PCIE_DEVCAP_L1_ACC(devcap));
+
+	xo_open_instance("device");
+	xo_emit("{k:bdf/%04x:%02x:%02x.%u}\n",
+			ep->domain, ep->bus, ep->dev, ep->func);
+
+	ltr = pci_find_ext_cap(ep, PCI_EXT_CAP_ID_LTR);
+	if (ltr && (devctl2 & PCIE_DEVCTL2_LTR)) {
+		uint16_t snoop = 0, nosnoop = 0;
+
+		read_cfg(ep, ltr + LTR_MAX_SNOOP, &snoop, 2);
+		read_cfg(ep, ltr + LTR_MAX_NOSNOOP, &nosnoop, 2);
+
+		xo_emit("    LTR max snoop ");
+		emit_ns("ltr-snoop", LTR_NS(snoop));
+		xo_emit(" no-snoop ");
+		emit_ns("ltr-nosnoop", LTR_NS(nosnoop));
+		xo_emit("\n");
+
+		if (snoop && (LTR_NS(snoop) < l1_acc))
+			l1_acc = LTR_NS(snoop);
+	}
+
+	xo_open_list("link");
+
+	/*
+	 * Walk up the hierarchy one link at a time. Each link connects the
+	 * upstream port of a device (or switch) to a downstream port.
+	 */
+	while ((up != NULL) && ((dp = tree_parent(up)) != NULL)) {
+		uint32_t up_cap, dp_cap;
+		uint32_t up_lnkcap = 0, dp_lnkcap = 0;
+		uint16_t up_lnkctl = 0, dp_lnkctl = 0, enabled;
+		uint32_t l1ss_ctl = 0;
+		uint64_t l0s, l1;
+
+		up_cap = pci_find_cap(up, PCI_CAP_ID_EXP);
+		dp_cap = pci_find_cap(dp, PCI_CAP_ID_EXP);
+		if ((up_cap == 0) || (dp_cap == 0))
+			break;
+
+		read_cfg(up, up_cap + PCIE_LNKCAP, &up_lnkcap, 4);
+		read_cfg(up, up_cap + PCIE_LNKCTL, &up_lnkctl, 2);
+		read_cfg(dp, dp_cap + PCIE_LNKCAP, &dp_lnkcap, 4);
+		read_cfg(dp, dp_cap + PCIE_LNKCTL, &dp_lnkctl, 2);
+
+		l0s = l0s_exit_ns(PCIE_LNKCAP_L0S_EXIT(up_lnkcap));
+		if (l0s_exit_ns(PCIE_LNKCAP_L0S_EXIT(dp_lnkcap)) > l0s)
+			l0s = l0s_exit_ns(PCIE_LNKCAP_L0S_EXIT(dp_lnkcap));
+
+		l1 = l1_exit_ns(PCIE_LNKCAP_L1_EXIT(up_lnkcap));
+		if (l1_exit_ns(PCIE_LNKCAP_L1_EXIT(dp_lnkcap)) > l1)
+			l1 = l1_exit_ns(PCIE_LNKCAP_L1_EXIT(dp_lnkcap));
+
+		/* The L1.2 substate adds the power on time to the L1 exit */
+		l1ss = pci_find_ext_cap(up, PCI_EXT_CAP_ID_L1SS);
+		if (l1ss) {
+			uint32_t ctl2 = 0;
+
+			read_cfg(up, l1ss + L1SS_CTL1, &l1ss_ctl, 4);
+			read_cfg(up, l1ss + L1SS_CTL2, &ctl2, 4);
+			if (l1ss_ctl & L1SS_CTL1_ASPM_L12)
+				l1 += L1SS_CTL2_T_PWR_ON_US(ctl2) * 1000ULL;
+		}
+
+		/* Either end of the link may enter a low power state */
+		enabled = up_lnkctl | dp_lnkctl;
+
+		xo_open_instance("link");
+		xo_emit("    {:downstream/%04x:%02x:%02x.%u} => {:upstream/%04x:%02x:%02x.%u} ",
+				dp->domain, dp->bus, dp->dev, dp->func,
+				up->domain, up->bus, up->dev, up->func);
+		xo_emit("ASPM {:aspm/%s} L0s exit ", aspm_str(enabled));
+		emit_ns("l0s-exit", l0s);
+		xo_emit(" L1 exit ");
+		emit_ns("l1-exit", l1);
+		if (l1ss_ctl & (L1SS_CTL1_ASPM_L11 | L1SS_CTL1_ASPM_L12)) {
+			xo_emit(" L1SS{:l1ss/%s}{:l1ss/%s}",
+					l1ss_ctl & L1SS_CTL1_ASPM_L11 ? " L1.1" : "",
+					l1ss_ctl & L1SS_CTL1_ASPM_L12 ? " L1.2" : "");
+		}
+		xo_emit("\n");
+		xo_close_instance("link");
+
+		if (enabled & PCIE_LNKCTL_ASPM_L0S) {
+			l0s_path += l0s;
+			if (l0s > l0s_max) {
+				l0s_max = l0s;
+				l0s_worst = dp;
+			}
+		}
+
+		if ((enabled & PCIE_LNKCTL_ASPM_L1) && (l1 > l1_max)) {
+			l1_max = l1;
+			l1_worst = dp;
+		}
+
+		/* Continue from the switch's upstream port */
+		up = tree_parent(dp);
+		if (up != NULL)
+			switches++;
+	}
+
+	xo_close_list("link");
+
+	if (l1_worst != NULL)
+		l1_path = l1_max + (uint64_t)switches * SWITCH_L1_NS;
+
+	xo_emit("    L0s path ");
+	emit_ns("l0s-latency", l0s_path);
+	xo_emit(" acceptable ");
+	emit_ns("l0s-acceptable", l0s_acc);
+	if ((l0s_acc != NO_LIMIT) && (l0s_path > l0s_acc)) {
+		xo_emit(" {:l0s-status/exceeded} by link to {:l0s-link/%04x:%02x:%02x.%u}",
+				l0s_worst->domain, l0s_worst->bus, l0s_worst->dev,
+				l0s_worst->func);
+	}
+	xo_emit("\n");
+
+	xo_emit("    L1 path ");
+	emit_ns("l1-latency", l1_path);
+	xo_emit(" acceptable ");
+	emit_ns("l1-acceptable", l1_acc);
+	if ((l1_acc != NO_LIMIT) && (l1_path > l1_acc)) {
+		xo_emit(" {:l1-status/exceeded} by link to {:l1-link/%04x:%02x:%02x.%u}",
+				l1_worst->domain, l1_worst->bus, l1_worst->dev,
+				l1_worst->func);
+	}
+	xo_emit("\n");
+
+	xo_close_instance("device");
+}
+
+/**
+ * Report ASPM state and exit latencies from each endpoint to its root port
+ */
+void
+aspm(int argc, char *argv[])
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct pci_slot_match *pmatch = NULL;
+	const char *sel_str = NULL;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "s:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 's':
+			sel_str = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	if (sel_str != NULL) {
+		pmatch = parse_selector(sel_str);
+		if (pmatch == NULL)
+			return;
+	}
+
+	tree_build();
+
+	iter = pci_slot_match_iterator_create(pmatch);
+
+	xo_open_list("device");
+
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		uint32_t cap;
+		uint16_t caps = 0;
+
+		cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+		if (cap == 0)
+			continue;
+
+		read_cfg(pdev, cap + PCIE_CAPS, &caps, 2);
+		if ((PCIE_CAPS_TYPE(caps) != PCIE_TYPE_ENDPOINT) &&
+				(PCIE_CAPS_TYPE(caps) != PCIE_TYPE_LEG_ENDPOINT))
+			continue;
+
+		aspm_path(pdev, cap);
+	}
+
+	xo_close_list("device");
+
+	pci_iterator_destroy(iter);
+	free(pmatch);
+	tree_free();
+}
@@ -0,0 +1,354 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Address map report
+ *
+ * Decodes the Base Address Registers (BAR) of devices and the address
+ * windows bridges forward downstream. BARs which implement the Resizable
+ * BAR capability also show the current and supported sizes, making it
+ * easy to spot BARs firmware left smaller than the device supports or
+ * placed below 4 GiB.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern struct pci_slot_match *parse_selector(const char *s);
+extern void pci_device_get_names(const struct pci_device *pdev,
+		const char **cname, const char **vname, const char **dname);
+
+void bars_emit(struct pci_device *pdev, uint32_t indent);
+
+#define PCI_NUM_BARS		6
+#define PCI_NUM_BARS_BRIDGE	2
+
+/* BARs at least this large are expected to be 64-bit and above 4 GiB */
+#define BAR_LARGE		(256ULL << 20)
+#define ADDR_4G			(1ULL << 32)
+
+static struct option opts[] = {
+	{ "selector", required_argument, NULL, 's'},
+	{ NULL, 0, NULL, 0 }
+};
+
+struct rebar {
+	uint64_t cur;	/* current size in bytes */
+	uint64_t min;	/* smallest supported size */
+	uint64_t max;	/* largest supported size */
+};
+
+/**
+ * Format a size using the largest binary unit which divides it evenly
+ */
+static const char *
+size_str(uint64_t size, char *buf, size_t len)
+{
+	static const char units[] = "BKMGTPE";
+	uint32_t u = 0;
+
+	while ((size != 0) && ((size & 1023) == 0) && (u < sizeof(units) - 2)) {
+		size >>= 10;
+		u++;
+	}
+
+	snprintf(buf, len, "%ju%c", (uintmax_t)size, units[u]);
+
+	return buf;
+}
+
+static void
+emit_size(const char *name, uint64_t size)
+{
+	char fmt[64], buf[32];
+
+	snprintf(fmt, sizeof(fmt), "{d:%s/%%s}{e:%s/%%ju}", name, name);
+	xo_emit(fmt, size_str(size, buf, sizeof(buf)), (uintmax_t)size);
+}
+
+/**
+ * Read the Resizable BAR capability into a table indexed by BAR
+ *
+ * Returns non-zero if the device implements the capability
+ */
+static int
+rebar_read(struct pci_device *pdev, struct rebar *rb)
+{
+	uint32_t cap, ctl = 0, sizes, i, nbar;
+	int n;
+
+	cap = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_REBAR);
+	if ((cap == 0) || read_cfg(pdev, cap + REBAR_CTL(0), &ctl, 4))
+		return 0;
+
+	nbar = REBAR_CTL_NBAR(ctl);
+	if ((nbar == 0) || (nbar > PCI_NUM_BARS))
+		return 0;
+
+	for (i = 0; i < nbar; i++) {
+		uint64_t supported;
+		struct rebar *r;
+
+		sizes = ctl = 0;
+		read_cfg(pdev, cap + REBAR_CAP(i), &sizes, 4);
+		read_cfg(pdev, cap + REBAR_CTL(i), &ctl, 4);
+
+		if (REBAR_CTL_IDX(ctl) >= PCI_NUM_BARS)
+			continue;
+
+		r = &rb[REBAR_CTL_IDX(ctl)];
+		r->cur = 1ULL << (REBAR_CTL_SIZE(ctl) + 20);
+
+		/* Sizes of 256 TiB and up are in the control register */
+		supported = REBAR_CAP_SIZES(sizes) |
+			((uint64_t)REBAR_CTL_SIZES(ctl) << 28);
+		if (supported == 0)
+			continue;
+
+		for (n = 0; !(supported & (1ULL << n)); n++)
+			;
+		r->min = 1ULL << (n + 20);
+
+		for (n = 43; !(supported & (1ULL << n)); n--)
+			;
+		r->max = 1ULL << (n + 20);
+	}
+
+	return 1;
+}
+
+static void
+emit_bars(struct pci_device *pdev, uint32_t indent, uint32_t nbars)
+{
+	struct rebar rb[PCI_NUM_BARS] = { { 0, 0, 0 } };
+	uint32_t i;
+
+	if (pci_device_probe(pdev))
+		return;
+
+	rebar_read(pdev, rb);
+
+	xo_open_list("bar");
+
+	for (i = 0; i < nbars; i++) {
+		const struct pci_mem_region *r = &pdev->regions[i];
+		const char *type;
+
+		if (r->size == 0)
+			continue;
+
+		if (r->is_IO)
+			type = "io";
+		else if (r->is_64)
+			type = r->is_prefetchable ? "mem64-pref" : "mem64";
+		else
+			type = r->is_prefetchable ? "mem32-pref" : "mem32";
+
+		xo_open_instance("bar");
+
+		xo_emit("{P:/%*s}BAR{k:index/%u} {:type/%-10s} {:base/0x%016jx} ",
+				indent, "", i, type, (uintmax_t)r->base_addr);
+		emit_size("size", r->size);
+
+		if (rb[i].cur != 0) {
+			xo_emit(" rebar ");
+			emit_size("rebar-current", rb[i].cur);
+			xo_emit(" of ");
+			emit_size("rebar-min", rb[i].min);
+			xo_emit("-");
+			emit_size("rebar-max", rb[i].max);
+		}
+
+		/*
+		 * Firmware often sizes BARs to fit below 4 GiB, leaving the
+		 * device only a window onto its memory
+		 */
+		if (rb[i].cur < rb[i].max)
+			xo_emit(" {l:flag/shrunk}");
+
+		if (!r->is_IO && (r->size >= BAR_LARGE) &&
+				(r->base_addr + r->size <= ADDR_4G))
+			xo_emit(" {l:flag/below-4g}");
+
+		xo_emit("\n");
+
+		xo_close_instance("bar");
+	}
+
+	xo_close_list("bar");
+}
+
+static void
+emit_window(const char *name, uint64_t base, uint64_t limit, uint32_t indent)
+{
+
+	xo_open_instance("window");
+
+	xo_emit("{P:/%*s}{k:name/%-8s} ", indent, "", name);
+
+	if (limit < base) {
+		xo_emit("{:status/disabled}\n");
+	} else {
+		xo_emit("{:base/0x%016jx}-{:limit/0x%016jx} ",
+				(uintmax_t)base, (uintmax_t)limit);
+		emit_size("size", limit - base + 1);
+		xo_emit("\n");
+	}
+
+	xo_close_instance("window");
+}
+
+/**
+ * Decode the I/O, memory, and prefetchable memory windows of a bridge
+ */
+static void
+emit_windows(struct pci_device *pdev, uint32_t indent)
+{
+	uint64_t base, limit;
+	uint32_t upper = 0;
+	uint16_t b16 = 0, l16 = 0;
+	uint8_t b8 = 0, l8 = 0;
+
+	xo_open_list("window");
+
+	read_cfg(pdev, PCI_IO_BASE, &b8, 1);
+	read_cfg(pdev, PCI_IO_LIMIT, &l8, 1);
+	base = (uint64_t)(b8 & 0xf0) << 8;
+	limit = ((uint64_t)(l8 & 0xf0) << 8) | 0xfff;
+	if (b8 & PCI_IO_32BIT) {
+		read_cfg(pdev, PCI_IO_BASE_UPPER, &b16, 2);
+		read_cfg(pdev, PCI_IO_LIMIT_UPPER, &l16, 2);
+		base |= (uint64_t)b16 << 16;
+		limit |= (uint64_t)l16 << 16;
+	}
+	emit_window("io", base, limit, indent);
+
+	b16 = l16 = 0;
+	read_cfg(pdev, PCI_MEM_BASE, &b16, 2);
+	read_cfg(pdev, PCI_MEM_LIMIT, &l16, 2);
+	base = (uint64_t)(b16 & 0xfff0) << 16;
+	limit = ((uint64_t)(l16 & 0xfff0) << 16) | 0xfffff;
+	emit_window("mem", base, limit, indent);
+
+	b16 = l16 = 0;
+	read_cfg(pdev, PCI_PREF_BASE, &b16, 2);
+	read_cfg(pdev, PCI_PREF_LIMIT, &l16, 2);
+	base = (uint64_t)(b16 & 0xfff0) << 16;
+	limit = ((uint64_t)(l16 & 0xfff0) << 16) | 0xfffff;
+	if (b16 & PCI_PREF_64BIT) {
+		read_cfg(pdev, PCI_PREF_BASE_UPPER, &upper, 4);
+		base |= (uint64_t)upper << 32;
+		upper = 0;
+		read_cfg(pdev, PCI_PREF_LIMIT_UPPER, &upper, 4);
+		limit |= (uint64_t)upper << 32;
+	}
+	emit_window(b16 & PCI_PREF_64BIT ? "pref64" : "pref32", base, limit,
+			indent);
+
+	xo_close_list("window");
+}
+
+/**
+ * Display the BARs of a device and, for bridges, the forwarded windows
+ */
+void
+bars_emit(struct pci_device *pdev, uint32_t indent)
+{
+	uint8_t hdr = 0;
+
+	read_cfg(pdev, PCI_HEADER_TYPE, &hdr, 1);
+
+	switch (hdr & PCI_HEADER_TYPE_MASK) {
+	case PCI_HEADER_TYPE_NORMAL:
+		emit_bars(pdev, indent, PCI_NUM_BARS);
+		break;
+	case PCI_HEADER_TYPE_BRIDGE:
+		emit_bars(pdev, indent, PCI_NUM_BARS_BRIDGE);
+		emit_windows(pdev, indent);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Report the address map of each device
+ */
+void
+bars(int argc, char *argv[])
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct pci_slot_match *pmatch = NULL;
+	const char *sel_str = NULL;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "s:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 's':
+			sel_str = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	if (sel_str != NULL) {
+		pmatch = parse_selector(sel_str);
+		if (pmatch == NULL)
+			return;
+	}
+
+	iter = pci_slot_match_iterator_create(pmatch);
+
+	xo_open_list("device");
+
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		const char *cname = NULL, *vname = NULL, *dname = NULL;
+
+		pci_device_get_names(pdev, &cname, &vname, &dname);
+
+		xo_open_instance("device");
+
+		xo_emit("{k:bdf/%04x:%02x:%02x.%u} {:classname} {:vendorname} {:devname}\n",
+				pdev->domain, pdev->bus, pdev->dev, pdev->func,
+				cname, vname, dname);
+
+		bars_emit(pdev, 4);
+
+		xo_close_instance("device");
+	}
+
+	xo_close_list("device");
+
+	pci_iterator_destroy(iter);
+	free(pmatch);
+}
@@ -0,0 +1,277 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <getopt.h>
+#include <time.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern void usage(void);
+extern struct pci_slot_match *parse_selector(const char *s);
+extern void tree_build(void);
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+extern void tree_free(void);
+
+#define BENCH_ITERATIONS	100
+#define BENCH_MAX_ITERATIONS	1000000
+#define BENCH_MAX_OFFSETS	3
+
+static struct option opts[] = {
+	{ "iterations", required_argument, NULL, 'i'},
+	{ "selector", required_argument, NULL, 's'},
+	{ NULL, 0, NULL, 0 }
+};
+
+struct bench_dev {
+	struct pci_device *pdev;
+	uint32_t *samples;	/* read latencies in ns */
+	uint32_t nsamples;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+sample_cmp(const void *a, const void *b)
+{
+	uint32_t sa = *(const uint32_t *)a, sb = *(const uint32_t *)b;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+/**
+ * Time reads of the header, the first capability, and (for PCI Express
+ * devices) extended configuration space at each access width
+ */
+static void
+bench_dev(struct bench_dev *bd, uint32_t iterations)
+{
+	struct pci_device *pdev = bd->pdev;
+	uint32_t offsets[BENCH_MAX_OFFSETS];
+	uint32_t noff = 0, i, o, w;
+	uint8_t ptr = 0;
+
+	offsets[noff++] = 0;
+
+	if ((read_cfg(pdev, PCI_CAP_PTR, &ptr, 1) == 0) && (ptr >= 0x40))
+		offsets[noff++] = ptr & ~3;
+
+	if (pci_find_cap(pdev, PCI_CAP_ID_EXP))
+		offsets[noff++] = PCI_CFG_SIZE;
+
+	bd->samples = calloc((size_t)iterations * noff, 3 * sizeof(uint32_t));
+	if (bd->samples == NULL)
+		err(1, "bench");
+
+	for (i = 0; i < iterations; i++) {
+		for (o = 0; o < noff; o++) {
+			for (w = 1; w <= 4; w <<= 1) {
+				uint32_t v = 0;
+				uint64_t start;
+
+				start = now_ns();
+				if (read_cfg(pdev, offsets[o], &v, w))
+					continue;
+				bd->samples[bd->nsamples++] = now_ns() - start;
+			}
+		}
+	}
+}
+
+static void
+emit_latency(uint32_t *samples, uint32_t n)
+{
+
+	qsort(samples, n, sizeof(uint32_t), sample_cmp);
+
+	xo_emit(" {Lw:reads}{:reads/%u} {Lw:min}{:min/%u}{U:ns} "
+			"{Lw:p50}{:p50/%u}{U:ns} {Lw:p99}{:p99/%u}{U:ns} "
+			"{Lw:max}{:max/%u}{U:ns}\n",
+			n, samples[0], samples[n / 2],
+			samples[((uint64_t)n * 99) / 100],
+			samples[n - 1]);
+}
+
+static int
+is_ancestor(const struct pci_device *bridge, const struct pci_device *pdev)
+{
+	const struct pci_device *p;
+
+	for (p = tree_parent(pdev); p != NULL; p = tree_parent(p)) {
+		if (p == bridge)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Combine the samples of every benchmarked device below each bridge
+ */
+static void
+bench_subtrees(struct bench_dev *bd, uint32_t ndev)
+{
+	uint32_t *samples = NULL;
+	uint32_t i, j;
+
+	xo_open_list("subtree");
+
+	for (i = 0; i < ndev; i++) {
+		uint32_t n = 0, ndesc = 0;
+
+		if (pci_device_get_bridge_info(bd[i].pdev) == NULL)
+			continue;
+
+		for (j = 0; j < ndev; j++) {
+			uint32_t *s;
+
+			if ((j != i) && !is_ancestor(bd[i].pdev, bd[j].pdev))
+				continue;
+
+			s = realloc(samples, (n + bd[j].nsamples) * sizeof(uint32_t));
+			if (s == NULL)
+				err(1, "bench");
+			samples = s;
+
+			memcpy(samples + n, bd[j].samples,
+					bd[j].nsamples * sizeof(uint32_t));
+			n += bd[j].nsamples;
+			ndesc++;
+		}
+
+		if (n == 0)
+			continue;
+
+		xo_open_instance("subtree");
+		xo_emit("{Lw:subtree}{k:bdf/%04x:%02x:%02x.%u} {Lw:devices}{:devices/%u}",
+				bd[i].pdev->domain, bd[i].pdev->bus,
+				bd[i].pdev->dev, bd[i].pdev->func, ndesc);
+		emit_latency(samples, n);
+		xo_close_instance("subtree");
+	}
+
+	xo_close_list("subtree");
+
+	free(samples);
+}
+
+/**
+ * Measure configuration read latency of matching devices
+ */
+void
+bench(int argc, char *argv[])
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct pci_slot_match *pmatch = NULL;
+	struct bench_dev *bd = NULL;
+	const char *sel_str = NULL;
+	uint32_t iterations = BENCH_ITERATIONS;
+	uint32_t ndev = 0, i;
+	unsigned long n;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "i:s:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'i':
+			n = strtoul(optarg, NULL, 0);
+			/* Out of range counts are rejected as 0 below */
+			iterations = n > BENCH_MAX_ITERATIONS ? 0 : n;
+			break;
+		case 's':
+			sel_str = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ((argc < 1) || (strcmp(argv[0], "cfg") != 0) || (iterations == 0)) {
+		usage();
+		return;
+	}
+
+	if (sel_str != NULL) {
+		pmatch = parse_selector(sel_str);
+		if (pmatch == NULL)
+			return;
+	}
+
+	tree_build();
+
+	iter = pci_slot_match_iterator_create(pmatch);
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		struct bench_dev *b;
+
+		b = realloc(bd, (ndev + 1) * sizeof(struct bench_dev));
+		if (b == NULL)
+			err(1, "bench");
+		bd = b;
+		b = &bd[ndev++];
+
+		memset(b, 0, sizeof(struct bench_dev));
+		b->pdev = pdev;
+
+		bench_dev(b, iterations);
+	}
+	pci_iterator_destroy(iter);
+
+	xo_open_list("device");
+	for (i = 0; i < ndev; i++) {
+		if (bd[i].nsamples == 0)
+			continue;
+
+		xo_open_instance("device");
+		xo_emit("{k:bdf/%04x:%02x:%02x.%u}", bd[i].pdev->domain,
+				bd[i].pdev->bus, bd[i].pdev->dev, bd[i].pdev->func);
+		emit_latency(bd[i].samples, bd[i].nsamples);
+		xo_close_instance("device");
+	}
+	xo_close_list("device");
+
+	bench_subtrees(bd, ndev);
+
+	for (i = 0; i < ndev; i++)
+		free(bd[i].samples);
+	free(bd);
+	free(pmatch);
+	tree_free();
+}
@@ -0,0 +1,116 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+/* Bound the capability walks in case of loops in broken lists */
+#define MAX_CAPS	48
+#define MAX_EXT_CAPS	((PCI_CFG_SIZE_EXT - PCI_CFG_SIZE) / 8)
+
+/*
+ * Per lane TLP bandwidth in MB/s, indexed by link speed. 8b/10b for 2.5
+ * and 5 GT/s, 128b/130b up to 32 GT/s. At 64 GT/s, TLPs fill 236 of each
+ * 256 byte flit with DLLPs, CRC and FEC in the rest.
+ */
+const uint32_t pcie_lane_mbps[PCIE_NUM_SPEEDS] = {
+	0, 250, 500, 985, 1969, 3938, 7375
+};
+
+/**
+ * Find a capability in the standard capability list
+ *
+ * Returns the offset of the capability or 0 if not found
+ */
+uint32_t
+pci_find_cap(struct pci_device *pdev, uint8_t id)
+{
+	uint16_t status = 0;
+	uint8_t ptr = 0;
+	uint32_t n;
+
+	if (read_cfg(pdev, PCI_STATUS, &status, 2) ||
+			!(status & PCI_STATUS_CAP_LIST)) {
+		return 0;
+	}
+
+	if (read_cfg(pdev, PCI_CAP_PTR, &ptr, 1)) {
+		return 0;
+	}
+
+	for (n = 0; (ptr >= 0x40) && (n < MAX_CAPS); n++) {
+		uint16_t hdr = 0;
+
+		ptr &= ~3;
+		if (read_cfg(pdev, ptr, &hdr, 2)) {
+			break;
+		}
+
+		if ((hdr & 0xff) == id) {
+			return ptr;
+		}
+
+		ptr = hdr >> 8;
+	}
+
+	return 0;
+}
+
+/**
+ * Find a capability in the extended capability list
+ *
+ * Returns the offset of the capability or 0 if not found
+ */
+uint32_t
+pci_find_ext_cap(struct pci_device *pdev, uint16_t id)
+{
+	uint32_t ptr = PCI_CFG_SIZE;
+	uint32_t n;
+
+	/* Only PCI Express devices have extended configuration space */
+	if (pci_find_cap(pdev, PCI_CAP_ID_EXP) == 0) {
+		return 0;
+	}
+
+	for (n = 0; (ptr >= PCI_CFG_SIZE) && (n < MAX_EXT_CAPS); n++) {
+		uint32_t hdr = 0;
+
+		if (read_cfg(pdev, ptr, &hdr, 4) || (hdr == 0) ||
+				(hdr == UINT32_MAX)) {
+			break;
+		}
+
+		if ((hdr & 0xffff) == id) {
+			return ptr;
+		}
+
+		ptr = (hdr >> 20) & 0xffc;
+	}
+
+	return 0;
+}
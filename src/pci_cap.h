@@ -0,0 +1,258 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Capability definitions and configuration space helpers shared by the
+ * commands which decode capabilities
+ */
+
+#define PCI_CFG_SIZE		256
+#define PCI_CFG_SIZE_EXT	4096
+
+#define PCI_VENDOR_ID		0x00
+#define PCI_COMMAND		0x04
+#define PCI_STATUS		0x06
+#define   PCI_STATUS_IMM_READY	0x0001
+#define   PCI_STATUS_CAP_LIST	0x0010
+#define PCI_HEADER_TYPE		0x0e
+#define   PCI_HEADER_TYPE_MASK	0x7f
+#define   PCI_HEADER_TYPE_NORMAL 0x00
+#define   PCI_HEADER_TYPE_BRIDGE 0x01
+#define PCI_CAP_PTR		0x34
+
+/* Type 1 (bridge) header bus numbers, primary to subordinate */
+#define PCI_PRIMARY_BUS		0x18
+#define   PCI_BUS_NUMBERS_MASK	0x00ffffff
+
+/* Type 1 (bridge) header address windows */
+#define PCI_IO_BASE		0x1c
+#define PCI_IO_LIMIT		0x1d
+#define   PCI_IO_32BIT		0x01
+#define PCI_MEM_BASE		0x20
+#define PCI_MEM_LIMIT		0x22
+#define PCI_PREF_BASE		0x24
+#define PCI_PREF_LIMIT		0x26
+#define   PCI_PREF_64BIT	0x0001
+#define PCI_PREF_BASE_UPPER	0x28
+#define PCI_PREF_LIMIT_UPPER	0x2c
+#define PCI_IO_BASE_UPPER	0x30
+#define PCI_IO_LIMIT_UPPER	0x32
+#define PCI_BRIDGE_CTL		0x3e
+#define   PCI_BRIDGE_CTL_SBR	0x0040	/* Secondary Bus Reset */
+
+/* Capability IDs */
+#define PCI_CAP_ID_PM		0x01
+#define PCI_CAP_ID_VPD		0x03
+#define PCI_CAP_ID_MSI		0x05
+#define PCI_CAP_ID_EXP		0x10
+#define PCI_CAP_ID_MSIX		0x11
+
+/* Extended Capability IDs */
+#define PCI_EXT_CAP_ID_DSN	0x03
+#define PCI_EXT_CAP_ID_ACS	0x0d
+#define PCI_EXT_CAP_ID_ATS	0x0f
+#define PCI_EXT_CAP_ID_SRIOV	0x10
+#define PCI_EXT_CAP_ID_PRI	0x13
+#define PCI_EXT_CAP_ID_REBAR	0x15
+#define PCI_EXT_CAP_ID_LTR	0x18
+#define PCI_EXT_CAP_ID_PASID	0x1b
+#define PCI_EXT_CAP_ID_L1SS	0x1e
+#define PCI_EXT_CAP_ID_RTR	0x22
+
+/* Power Management registers */
+#define PM_PMC			0x02
+#define   PM_PMC_VERSION(x)	((x) & 0x7)
+#define   PM_PMC_IMM_READY	0x0010	/* Immediate Readiness on Return to D0 */
+#define   PM_PMC_D1		0x0200
+#define   PM_PMC_D2		0x0400
+#define   PM_PMC_PME(x)		(((x) >> 11) & 0x1f)	/* D0, D1, D2, D3hot, D3cold */
+#define PM_CTRL			0x04
+#define   PM_CTRL_STATE		0x0003
+#define   PM_CTRL_D0		0x0000
+#define   PM_CTRL_D3HOT		0x0003
+#define   PM_CTRL_NSR		0x0008	/* No Soft Reset */
+#define   PM_CTRL_PME_EN	0x0100
+#define   PM_CTRL_PME_STATUS	0x8000
+
+/* MSI and MSI-X Message Control */
+#define MSI_CTL			0x02
+#define   MSI_CTL_64BIT		0x0080
+#define   MSI_CTL_PVM		0x0100	/* Per-Vector Masking */
+
+/* MSI registers, which move up a dword with 64-bit addresses */
+#define MSI_ADDR_LO		0x04
+#define MSI_ADDR_HI		0x08
+#define MSI_DATA(ctl)		((ctl) & MSI_CTL_64BIT ? 0x0c : 0x08)
+#define MSI_MASK(ctl)		((ctl) & MSI_CTL_64BIT ? 0x10 : 0x0c)
+
+/* Vital Product Data registers */
+#define VPD_ADDR		0x02
+#define   VPD_ADDR_F		0x8000
+#define   VPD_ADDR_MASK		0x7ffc
+#define VPD_DATA		0x04
+#define VPD_MAX_SIZE		0x8000
+
+/* Device Serial Number registers */
+#define DSN_LOW			0x04
+#define DSN_HIGH		0x08
+
+/* Access Control Services registers */
+#define ACS_CAP			0x04
+#define ACS_CTL			0x06
+#define   ACS_SV		0x0001	/* Source Validation */
+#define   ACS_TB		0x0002	/* Translation Blocking */
+#define   ACS_RR		0x0004	/* P2P Request Redirect */
+#define   ACS_CR		0x0008	/* P2P Completion Redirect */
+#define   ACS_UF		0x0010	/* Upstream Forwarding */
+#define   ACS_EC		0x0020	/* P2P Egress Control */
+#define   ACS_DT		0x0040	/* Direct Translated P2P */
+
+/* Address Translation Services registers */
+#define ATS_CTL			0x06
+#define   ATS_CTL_EN		0x8000
+
+/* Page Request Interface registers */
+#define PRI_CTL			0x04
+#define   PRI_CTL_EN		0x0001
+
+/* Process Address Space ID registers */
+#define PASID_CTL		0x06
+#define   PASID_CTL_EN		0x0001
+
+/* SR-IOV registers */
+#define SRIOV_CTL		0x08
+#define   SRIOV_CTL_VFE		0x0001
+#define SRIOV_TOTAL_VFS		0x0e
+#define SRIOV_NUM_VFS		0x10
+#define SRIOV_VF_OFFSET		0x14
+#define SRIOV_VF_STRIDE		0x16
+#define SRIOV_VF_DID		0x1a
+
+/* Resizable BAR registers (one capability/control pair per BAR) */
+#define REBAR_CAP(n)		(0x04 + (n) * 8)
+#define   REBAR_CAP_SIZES(x)	(((x) >> 4) & 0x0fffffff)	/* bit n: 2^(n+20) */
+#define REBAR_CTL(n)		(0x08 + (n) * 8)
+#define   REBAR_CTL_IDX(x)	((x) & 0x7)
+#define   REBAR_CTL_NBAR(x)	(((x) >> 5) & 0x7)
+#define   REBAR_CTL_SIZE(x)	(((x) >> 8) & 0x3f)		/* 2^(x+20) */
+#define   REBAR_CTL_SIZES(x)	(((x) >> 16) & 0xffff)		/* bit n: 2^(n+48) */
+
+/* Latency Tolerance Reporting registers */
+#define LTR_MAX_SNOOP		0x04
+#define LTR_MAX_NOSNOOP		0x06
+#define   LTR_NS(x)		(((x) & 0x3ff) * (1ULL << (5 * (((x) >> 10) & 0x7))))
+
+/* L1 PM Substates registers */
+#define L1SS_CTL1		0x08
+#define   L1SS_CTL1_PCIPM_L12	0x1
+#define   L1SS_CTL1_PCIPM_L11	0x2
+#define   L1SS_CTL1_ASPM_L12	0x4
+#define   L1SS_CTL1_ASPM_L11	0x8
+#define L1SS_CTL2		0x0c
+#define   L1SS_CTL2_T_PWR_ON_US(x) ((((x) >> 3) & 0x1f) * \
+		(((x) & 0x3) == 0 ? 2 : ((x) & 0x3) == 1 ? 10 : 100))
+
+/* Readiness Time Reporting registers (times as in LTR with a 12-bit value) */
+#define RTR_1			0x04
+#define   RTR_VALID		0x80000000
+#define   RTR_RESET_TIME(x)	((x) & 0x7fff)
+#define   RTR_DLUP_TIME(x)	(((x) >> 16) & 0x7fff)
+#define RTR_2			0x08
+#define   RTR_FLR_TIME(x)	((x) & 0x7fff)
+#define   RTR_D3HOT_TIME(x)	(((x) >> 16) & 0x7fff)
+#define   RTR_NS(x)		(((x) & 0xfff) * (1ULL << (5 * (((x) >> 12) & 0x7))))
+
+/* PCI Express Capability registers (offsets from the capability) */
+#define PCIE_CAPS		0x02
+#define   PCIE_CAPS_TYPE(x)	(((x) >> 4) & 0xf)
+#define PCIE_DEVCAP		0x04
+#define   PCIE_DEVCAP_MPSS(x)	((x) & 0x7)
+#define   PCIE_DEVCAP_EXT_TAG	0x00000020
+#define   PCIE_DEVCAP_FLR	0x10000000
+#define PCIE_DEVCTL		0x08
+#define   PCIE_DEVCTL_RO	0x0010
+#define   PCIE_DEVCTL_MPS_SHIFT	5
+#define   PCIE_DEVCTL_MPS	(0x7 << PCIE_DEVCTL_MPS_SHIFT)
+#define   PCIE_DEVCTL_EXT_TAG	0x0100
+#define   PCIE_DEVCTL_AUX_PM	0x0400
+#define   PCIE_DEVCTL_NOSNOOP	0x0800
+#define   PCIE_DEVCTL_FLR	0x8000
+#define   PCIE_DEVCTL_MRRS_SHIFT 12
+#define   PCIE_DEVCTL_MRRS	(0x7 << PCIE_DEVCTL_MRRS_SHIFT)
+#define   PCIE_DEVCAP_L0S_ACC(x)	(((x) >> 6) & 0x7)
+#define   PCIE_DEVCAP_L1_ACC(x)	(((x) >> 9) & 0x7)
+#define PCIE_DEVSTA		0x0a
+#define   PCIE_DEVSTA_TRPND	0x0020	/* Transactions Pending */
+#define PCIE_LNKCAP		0x0c
+#define   PCIE_LNKCAP_SPEED(x)	((x) & 0xf)
+#define   PCIE_LNKCAP_WIDTH(x)	(((x) >> 4) & 0x3f)
+#define   PCIE_LNKCAP_ASPM(x)	(((x) >> 10) & 0x3)
+#define   PCIE_LNKCAP_L0S_EXIT(x) (((x) >> 12) & 0x7)
+#define   PCIE_LNKCAP_L1_EXIT(x) (((x) >> 15) & 0x7)
+#define   PCIE_LNKCAP_CLKPM	0x00040000
+#define PCIE_LNKCTL		0x10
+#define   PCIE_LNKCTL_ASPM_L0S	0x0001
+#define   PCIE_LNKCTL_ASPM_L1	0x0002
+#define   PCIE_LNKCTL_RCB	0x0008	/* Read Completion Boundary is 128 */
+#define   PCIE_LNKCTL_CLKREQ_EN	0x0100
+#define PCIE_LNKSTA		0x12
+#define   PCIE_LNKSTA_SPEED(x)	((x) & 0xf)
+#define   PCIE_LNKSTA_WIDTH(x)	(((x) >> 4) & 0x3f)
+#define PCIE_DEVCAP2		0x24
+#define   PCIE_DEVCAP2_ATOMIC_ROUTE	0x00000040
+#define   PCIE_DEVCAP2_ATOMIC_COMP32	0x00000080
+#define   PCIE_DEVCAP2_ATOMIC_COMP64	0x00000100
+#define   PCIE_DEVCAP2_ATOMIC_COMP128	0x00000200
+#define   PCIE_DEVCAP2_10BIT_TAG_COMP	0x00010000
+#define   PCIE_DEVCAP2_10BIT_TAG_REQ	0x00020000
+#define PCIE_DEVCTL2		0x28
+#define   PCIE_DEVCTL2_ATOMIC_REQ	0x0040
+#define   PCIE_DEVCTL2_ATOMIC_EGRESS_BLK	0x0080
+#define   PCIE_DEVCTL2_LTR	0x0400
+#define   PCIE_DEVCTL2_10BIT_TAG_REQ	0x1000
+#define PCIE_LNKCTL2		0x30
+
+/* PCI Express Device/Port types */
+#define PCIE_TYPE_ENDPOINT	0x0
+#define PCIE_TYPE_LEG_ENDPOINT	0x1
+#define PCIE_TYPE_ROOT_PORT	0x4
+#define PCIE_TYPE_UPSTREAM	0x5
+#define PCIE_TYPE_DOWNSTREAM	0x6
+#define PCIE_TYPE_PCIE_BRIDGE	0x7
+#define PCIE_TYPE_PCI_BRIDGE	0x8
+#define PCIE_TYPE_RC_ENDPOINT	0x9
+#define PCIE_TYPE_RC_EC		0xa
+
+/* Link speeds indexed by PCIE_LNKSTA_SPEED, 2.5 GT/s to 64 GT/s */
+#define PCIE_NUM_SPEEDS		7
+
+extern const uint32_t pcie_lane_mbps[PCIE_NUM_SPEEDS];
+
+extern int32_t read_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width);
+extern int32_t write_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width);
+
+extern uint32_t pci_find_cap(struct pci_device *pdev, uint8_t id);
+extern uint32_t pci_find_ext_cap(struct pci_device *pdev, uint16_t id);
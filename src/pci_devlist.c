@@ -24,17 +24,45 @@
  * SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+#include <err.h>
 #include <getopt.h>
 #include <libxo/xo.h>
 #include <pciaccess.h>
 
-extern const char *pci_device_get_class_name( const struct pci_device * );
+#include "pci_stats.h"
+
+extern void pci_device_get_names(const struct pci_device *pdev,
+		const char **cname, const char **vname, const char **dname);
 
 extern struct pci_slot_match *parse_selector(const char *s);
 
+extern void sriov_scan(const struct pci_slot_match *match);
+extern struct pci_device *sriov_vf_parent(const struct pci_device *pdev);
+extern void sriov_emit_vfs(const struct pci_device *pdev, uint32_t indent, int verbose);
+extern void sriov_free(void);
+
+extern void tree_build(void);
+extern void tree_free(void);
+extern void throughput_emit(struct pci_device *pdev, uint32_t indent);
+
+struct fields;
+struct field_rec;
+extern struct fields *fields_parse(const char *spec, const char *sort);
+extern struct field_rec *fields_rec(struct pci_device *pdev);
+extern struct pci_device *fields_rec_device(struct field_rec *r);
+extern void fields_sort(struct fields *f, struct field_rec **recs, uint32_t n);
+extern void fields_emit(struct fields *f, struct field_rec *r);
+
+#define MATCH(m, v)	(((m) == PCI_MATCH_ANY) || ((m) == (v)))
+
 static struct option opts[] = {
+	{ "expand", no_argument, NULL, 'e'},
+	{ "fields", required_argument, NULL, 'f'},
 	{ "number", no_argument, NULL, 'n'},
 	{ "selector", required_argument, NULL, 's'},
+	{ "sort", required_argument, NULL, 'S'},
+	{ "throughput", no_argument, NULL, 't'},
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -44,17 +72,32 @@ devlist(int argc, char *argv[])
 	struct pci_device_iterator *iter = NULL;
 	struct pci_device *pdev = NULL;
 	struct pci_slot_match *pmatch = NULL;
-	int ch, verbose = 1;
-	const char *sel_str = NULL;
+	struct fields *fields = NULL;
+	struct field_rec **recs = NULL;
+	uint32_t nrecs = 0, i;
+	int ch, verbose = 1, expand = 0, throughput = 0;
+	const char *sel_str = NULL, *field_str = NULL, *sort_str = NULL;
 
-	while ((ch = getopt_long(argc, argv, "ns:", opts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "ef:ns:S:t", opts, NULL)) != -1) {
 		switch (ch) {
+		case 'e':
+			expand = 1;
+			break;
+		case 'f':
+			field_str = optarg;
+			break;
+		case 'S':
+			sort_str = optarg;
+			break;
 		case 'n':
 			verbose = 0;
 			break;
 		case 's':
 			sel_str = optarg;
 			break;
+		case 't':
+			throughput = 1;
+			break;
 		default:
 			return;
 		}
@@ -69,20 +112,56 @@ devlist(int argc, char *argv[])
 #endif
 	}
 
+	if ((field_str != NULL) || (sort_str != NULL)) {
+		fields = fields_parse(field_str ? field_str : "bdf", sort_str);
+		if (fields == NULL)
+			return;
+	}
+
+	/* VFs are only grouped under PFs among the matched devices */
+	if (!expand)
+		sriov_scan(pmatch);
+
+	/* The best MPS depends on every device up to the root port */
+	if (throughput)
+		tree_build();
+
 	iter = pci_slot_match_iterator_create(pmatch);
 
 	xo_open_list("device");
 
-	while ((pdev = pci_device_next(iter)) != NULL) {
+	while ((pdev = stats_device_next(iter)) != NULL) {
+		if (!expand) {
+			struct pci_device *pf = sriov_vf_parent(pdev);
+
+			/* VFs are shown as a range under their PF */
+			if ((pf != NULL) && ((pmatch == NULL) ||
+					(MATCH(pmatch->domain, pf->domain) &&
+					 MATCH(pmatch->bus, pf->bus) &&
+					 MATCH(pmatch->dev, pf->dev) &&
+					 MATCH(pmatch->func, pf->func))))
+				continue;
+		}
+
+		/* Projected fields are displayed once all devices are known */
+		if (fields != NULL) {
+			struct field_rec **r;
+
+			r = realloc(recs, (nrecs + 1) * sizeof(struct field_rec *));
+			if (r == NULL)
+				err(1, "devlist");
+			recs = r;
+			recs[nrecs++] = fields_rec(pdev);
+			continue;
+		}
+
 		xo_open_instance("device");
 		xo_emit("{k:bdf/%04x:%02x:%02x.%u} ",
 				pdev->domain, pdev->bus, pdev->dev, pdev->func);
 		if (verbose) {
 			const char *cname = NULL, *vname = NULL, *dname = NULL;
 
-			cname = pci_device_get_class_name(pdev);
-			vname = pci_device_get_vendor_name(pdev);
-			dname = pci_device_get_device_name(pdev);
+			pci_device_get_names(pdev, &cname, &vname, &dname);
 
 			xo_emit("{k:classname}: {k:vendorname} {k:devname}\n", cname, vname, dname);
 		} else {
@@ -92,8 +171,39 @@ devlist(int argc, char *argv[])
 					pdev->device_class);
 		}
 
+		if (throughput)
+			throughput_emit(pdev, 4);
+
+		if (!expand)
+			sriov_emit_vfs(pdev, 4, verbose);
+
 		xo_close_instance("device");
 	}
 
+	if (fields != NULL) {
+		fields_sort(fields, recs, nrecs);
+
+		for (i = 0; i < nrecs; i++) {
+			xo_open_instance("device");
+			fields_emit(fields, recs[i]);
+			if (throughput)
+				throughput_emit(fields_rec_device(recs[i]), 4);
+			if (!expand)
+				sriov_emit_vfs(fields_rec_device(recs[i]), 4, verbose);
+			xo_close_instance("device");
+
+			free(recs[i]);
+		}
+
+		free(recs);
+		free(fields);
+	}
+
 	xo_close_list("device");
+
+	pci_iterator_destroy(iter);
+	free(pmatch);
+	sriov_free();
+	if (throughput)
+		tree_free();
 }
@@ -0,0 +1,352 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Audit of the PCI Express features affecting DMA throughput
+ *
+ * For each function, reports whether Relaxed Ordering, No Snoop, Extended
+ * and 10-Bit Tags, ATS, PRI, PASID and AtomicOps are supported and
+ * enabled, and which ports between an endpoint and its root port prevent
+ * the endpoint from using a feature.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern struct pci_slot_match *parse_selector(const char *s);
+extern void tree_build(void);
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+extern void tree_free(void);
+
+#define ATOMIC_COMP	(PCIE_DEVCAP2_ATOMIC_COMP32 | \
+		PCIE_DEVCAP2_ATOMIC_COMP64 | PCIE_DEVCAP2_ATOMIC_COMP128)
+
+/* Features without a control bit are reported as supported or not */
+#define NO_CTL		-1
+
+static struct option opts[] = {
+	{ "selector", required_argument, NULL, 's'},
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *type_name[] = {
+	"Endpoint", "Legacy Endpoint", "?", "?", "Root Port",
+	"Upstream Port", "Downstream Port", "PCIe to PCI Bridge",
+	"PCI to PCIe Bridge", "RC Integrated Endpoint", "RC Event Collector"
+};
+
+/* The DMA related registers of a function */
+struct dma_regs {
+	uint32_t cap;
+	uint8_t type;
+	uint32_t devcap;
+	uint16_t devctl;
+	uint32_t devcap2;
+	uint16_t devctl2;
+	uint32_t ats, pri, pasid;
+	uint16_t ats_ctl, pri_ctl, pasid_ctl;
+};
+
+static int
+dma_read(struct pci_device *pdev, struct dma_regs *r)
+{
+	uint16_t caps = 0;
+
+	r->cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+	if (r->cap == 0)
+		return 0;
+
+	read_cfg(pdev, r->cap + PCIE_CAPS, &caps, 2);
+	r->type = PCIE_CAPS_TYPE(caps);
+
+	r->devcap = r->devcap2 = 0;
+	r->devctl = r->devctl2 = 0;
+	read_cfg(pdev, r->cap + PCIE_DEVCAP, &r->devcap, 4);
+	read_cfg(pdev, r->cap + PCIE_DEVCTL, &r->devctl, 2);
+	read_cfg(pdev, r->cap + PCIE_DEVCAP2, &r->devcap2, 4);
+	read_cfg(pdev, r->cap + PCIE_DEVCTL2, &r->devctl2, 2);
+
+	r->ats_ctl = r->pri_ctl = r->pasid_ctl = 0;
+	r->ats = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_ATS);
+	if (r->ats)
+		read_cfg(pdev, r->ats + ATS_CTL, &r->ats_ctl, 2);
+	r->pri = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_PRI);
+	if (r->pri)
+		read_cfg(pdev, r->pri + PRI_CTL, &r->pri_ctl, 2);
+	r->pasid = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_PASID);
+	if (r->pasid)
+		read_cfg(pdev, r->pasid + PASID_CTL, &r->pasid_ctl, 2);
+
+	return 1;
+}
+
+static int
+is_endpoint(const struct dma_regs *r)
+{
+
+	return (r->type == PCIE_TYPE_ENDPOINT) ||
+		(r->type == PCIE_TYPE_LEG_ENDPOINT) ||
+		(r->type == PCIE_TYPE_RC_ENDPOINT);
+}
+
+static int
+is_switch_port(const struct dma_regs *r)
+{
+
+	return (r->type == PCIE_TYPE_UPSTREAM) ||
+		(r->type == PCIE_TYPE_DOWNSTREAM);
+}
+
+static void
+emit_feature(const char *name, int supported, int enabled)
+{
+	const char *state;
+
+	if (!supported)
+		state = "unsupported";
+	else if (enabled == NO_CTL)
+		state = "supported";
+	else
+		state = enabled ? "enabled" : "disabled";
+
+	xo_open_instance("feature");
+	xo_emit("    {k:name/%-20s} {:state/%s}", name, state);
+	xo_emit("{e:supported/%s}", supported ? "true" : "false");
+	if (enabled != NO_CTL)
+		xo_emit("{e:enabled/%s}", supported && enabled ? "true" : "false");
+	xo_close_instance("feature");
+}
+
+static void
+emit_features(const struct dma_regs *r)
+{
+
+	xo_open_list("feature");
+
+	emit_feature("relaxed-ordering", 1, r->devctl & PCIE_DEVCTL_RO);
+	xo_emit("\n");
+	emit_feature("no-snoop", 1, r->devctl & PCIE_DEVCTL_NOSNOOP);
+	xo_emit("\n");
+	emit_feature("ext-tag", r->devcap & PCIE_DEVCAP_EXT_TAG,
+			r->devctl & PCIE_DEVCTL_EXT_TAG);
+	xo_emit("\n");
+	emit_feature("10bit-tag-requester",
+			r->devcap2 & PCIE_DEVCAP2_10BIT_TAG_REQ,
+			r->devctl2 & PCIE_DEVCTL2_10BIT_TAG_REQ);
+	xo_emit("\n");
+	emit_feature("10bit-tag-completer",
+			r->devcap2 & PCIE_DEVCAP2_10BIT_TAG_COMP, NO_CTL);
+	xo_emit("\n");
+
+	if (is_endpoint(r)) {
+		emit_feature("ats", r->ats, r->ats_ctl & ATS_CTL_EN);
+		xo_emit("\n");
+		emit_feature("pri", r->pri, r->pri_ctl & PRI_CTL_EN);
+		xo_emit("\n");
+		emit_feature("pasid", r->pasid, r->pasid_ctl & PASID_CTL_EN);
+		xo_emit("\n");
+		/* Any function may request AtomicOps once allowed to */
+		emit_feature("atomic-requester", 1,
+				r->devctl2 & PCIE_DEVCTL2_ATOMIC_REQ);
+		xo_emit("\n");
+	} else {
+		emit_feature("atomic-routing",
+				r->devcap2 & PCIE_DEVCAP2_ATOMIC_ROUTE,
+				!(r->devctl2 & PCIE_DEVCTL2_ATOMIC_EGRESS_BLK));
+		xo_emit("\n");
+	}
+
+	emit_feature("atomic-completer", r->devcap2 & ATOMIC_COMP, NO_CTL);
+	if (r->devcap2 & ATOMIC_COMP) {
+		char widths[16];
+
+		snprintf(widths, sizeof(widths), "%s%s%s",
+				r->devcap2 & PCIE_DEVCAP2_ATOMIC_COMP32 ? " 32" : "",
+				r->devcap2 & PCIE_DEVCAP2_ATOMIC_COMP64 ? " 64" : "",
+				r->devcap2 & PCIE_DEVCAP2_ATOMIC_COMP128 ? " 128" : "");
+		xo_emit(" ({:atomic-widths/%s})", widths + 1);
+	}
+	xo_emit("\n");
+
+	xo_close_list("feature");
+}
+
+static void
+emit_blocked(const char *feature, struct pci_device *port, const char *reason)
+{
+
+	xo_open_instance("blocked");
+	xo_emit("    {:feature/%s} blocked by {:port/%04x:%02x:%02x.%u} ({:reason/%s})\n",
+			feature, port->domain, port->bus, port->dev, port->func,
+			reason);
+	xo_close_instance("blocked");
+}
+
+/**
+ * Find the ports between an endpoint and its root port which prevent
+ * the endpoint from using a feature it supports or has enabled
+ *
+ * AtomicOps need routing support in each switch, no egress blocking at
+ * the switch upstream ports and a completer behind the root port. 10-Bit
+ * Tag requests need 10-Bit Tag completer support in each port. Requests
+ * using addresses translated by ATS are blocked by ACS Translation
+ * Blocking in a downstream or root port.
+ */
+static uint32_t
+dma_upstream(struct pci_device *ep, const struct dma_regs *e)
+{
+	struct pci_device *port = ep;
+	struct dma_regs p;
+	uint32_t nblocked = 0;
+
+	xo_open_list("blocked");
+
+	while ((port = tree_parent(port)) != NULL) {
+		if (!dma_read(port, &p))
+			break;
+
+		if (e->devctl2 & PCIE_DEVCTL2_ATOMIC_REQ) {
+			if (is_switch_port(&p) &&
+					!(p.devcap2 & PCIE_DEVCAP2_ATOMIC_ROUTE)) {
+				emit_blocked("atomic-requester", port,
+						"AtomicOp routing not supported");
+				nblocked++;
+			}
+			if ((p.type == PCIE_TYPE_UPSTREAM) &&
+					(p.devctl2 & PCIE_DEVCTL2_ATOMIC_EGRESS_BLK)) {
+				emit_blocked("atomic-requester", port,
+						"AtomicOp egress blocking enabled");
+				nblocked++;
+			}
+			if ((p.type == PCIE_TYPE_ROOT_PORT) &&
+					!(p.devcap2 & ATOMIC_COMP)) {
+				emit_blocked("atomic-requester", port,
+						"no AtomicOp completer");
+				nblocked++;
+			}
+		}
+
+		if ((e->devctl2 & PCIE_DEVCTL2_10BIT_TAG_REQ) &&
+				!(p.devcap2 & PCIE_DEVCAP2_10BIT_TAG_COMP)) {
+			emit_blocked("10bit-tag-requester", port,
+					"10-Bit Tag completer not supported");
+			nblocked++;
+		}
+
+		if ((e->ats_ctl & ATS_CTL_EN) &&
+				((p.type == PCIE_TYPE_DOWNSTREAM) ||
+				 (p.type == PCIE_TYPE_ROOT_PORT))) {
+			uint32_t acs = pci_find_ext_cap(port, PCI_EXT_CAP_ID_ACS);
+			uint16_t ctl = 0;
+
+			if (acs)
+				read_cfg(port, acs + ACS_CTL, &ctl, 2);
+			if (ctl & ACS_TB) {
+				emit_blocked("ats", port,
+						"ACS Translation Blocking enabled");
+				nblocked++;
+			}
+		}
+
+		if (p.type == PCIE_TYPE_ROOT_PORT)
+			break;
+	}
+
+	xo_close_list("blocked");
+
+	return nblocked;
+}
+
+/**
+ * Report DMA throughput features and where they are blocked
+ */
+void
+dma_audit(int argc, char *argv[])
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct pci_slot_match *pmatch = NULL;
+	const char *sel_str = NULL;
+	uint32_t ndevs = 0, nblocked = 0;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "s:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 's':
+			sel_str = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	if (sel_str != NULL) {
+		pmatch = parse_selector(sel_str);
+		if (pmatch == NULL)
+			return;
+	}
+
+	tree_build();
+
+	iter = pci_slot_match_iterator_create(pmatch);
+
+	xo_open_list("device");
+
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		struct dma_regs r;
+
+		if (!dma_read(pdev, &r))
+			continue;
+
+		xo_open_instance("device");
+		xo_emit("{k:bdf/%04x:%02x:%02x.%u} {:type/%s}\n",
+				pdev->domain, pdev->bus, pdev->dev, pdev->func,
+				r.type < sizeof(type_name) / sizeof(type_name[0]) ?
+					type_name[r.type] : "?");
+
+		emit_features(&r);
+
+		if (is_endpoint(&r) && (dma_upstream(pdev, &r) != 0))
+			nblocked++;
+
+		xo_close_instance("device");
+		ndevs++;
+	}
+
+	xo_close_list("device");
+
+	xo_emit("{:devices/%u} {L:devices}, {:blocked/%u} {L:with blocked features}\n",
+			ndevs, nblocked);
+
+	pci_iterator_destroy(iter);
+	free(pmatch);
+	tree_free();
+}
@@ -0,0 +1,376 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Enhanced Configuration Access Mechanism (ECAM) backend
+ *
+ * Maps the memory mapped configuration space described by the ACPI MCFG
+ * table so that configuration reads and writes are plain loads and stores
+ * instead of a system call per register. A regular file laid out like an
+ * ECAM region (1 MiB per bus starting at bus 0 of segment 0) may be used
+ * in place of the hardware for testing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pciaccess.h>
+
+#define MCFG_PATH	"/sys/firmware/acpi/tables/MCFG"
+#define MEM_PATH	"/dev/mem"
+
+#define MCFG_HDR_LEN	44	/* ACPI header (36) + reserved (8) */
+#define MCFG_ENTRY_LEN	16
+
+#define ECAM_BUS_SHIFT	20
+#define ECAM_DEV_SHIFT	15
+#define ECAM_FUNC_SHIFT	12
+#define ECAM_CFG_SIZE	4096
+
+struct ecam_region {
+	uint16_t segment;
+	uint8_t start_bus;
+	uint8_t end_bus;
+	volatile uint8_t *base;
+	size_t len;
+};
+
+static struct ecam_region *regions = NULL;
+static uint32_t nregions = 0;
+
+static int32_t
+ecam_add_region(int fd, off_t pa, uint16_t seg, uint8_t start, uint8_t end)
+{
+	struct ecam_region *r;
+	size_t len;
+	void *va;
+
+	len = (size_t)(end - start + 1) << ECAM_BUS_SHIFT;
+
+	va = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, pa);
+	if (va == MAP_FAILED) {
+		return errno;
+	}
+
+	r = realloc(regions, (nregions + 1) * sizeof(struct ecam_region));
+	if (r == NULL) {
+		munmap(va, len);
+		return ENOMEM;
+	}
+
+	regions = r;
+	r = &regions[nregions++];
+	r->segment = seg;
+	r->start_bus = start;
+	r->end_bus = end;
+	r->base = va;
+	r->len = len;
+
+	return 0;
+}
+
+/**
+ * Map each ECAM region listed in the ACPI MCFG table via /dev/mem
+ */
+static int32_t
+ecam_init_mcfg(void)
+{
+	uint8_t *mcfg = NULL, *e;
+	struct stat sb;
+	ssize_t len;
+	int fd, mem = -1;
+	int32_t rc = 0;
+
+	fd = open(MCFG_PATH, O_RDONLY);
+	if (fd < 0) {
+		return errno;
+	}
+
+	if (fstat(fd, &sb) || (sb.st_size < MCFG_HDR_LEN)) {
+		/* sysfs reports the size of ACPI tables correctly */
+		close(fd);
+		return EINVAL;
+	}
+
+	mcfg = malloc(sb.st_size);
+	if (mcfg == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	len = read(fd, mcfg, sb.st_size);
+	close(fd);
+	if (len < MCFG_HDR_LEN) {
+		free(mcfg);
+		return EIO;
+	}
+
+	mem = open(MEM_PATH, O_RDWR | O_SYNC);
+	if (mem < 0) {
+		rc = errno;
+		free(mcfg);
+		return rc;
+	}
+
+	for (e = mcfg + MCFG_HDR_LEN; e + MCFG_ENTRY_LEN <= mcfg + len;
+			e += MCFG_ENTRY_LEN) {
+		uint64_t base;
+		uint16_t seg;
+
+		memcpy(&base, e, sizeof(base));
+		memcpy(&seg, e + 8, sizeof(seg));
+
+		/* The base address always corresponds to bus 0 */
+		rc = ecam_add_region(mem,
+				base + ((off_t)e[10] << ECAM_BUS_SHIFT),
+				seg, e[10], e[11]);
+		if (rc)
+			break;
+	}
+
+	close(mem);
+	free(mcfg);
+
+	return rc;
+}
+
+/**
+ * Map a file containing an ECAM image of segment 0
+ */
+static int32_t
+ecam_init_file(const char *path)
+{
+	struct stat sb;
+	int fd;
+	int32_t rc;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		return errno;
+	}
+
+	if (fstat(fd, &sb) || (sb.st_size < (1 << ECAM_BUS_SHIFT))) {
+		close(fd);
+		return EINVAL;
+	}
+
+	if (sb.st_size > (256 << ECAM_BUS_SHIFT))
+		sb.st_size = 256 << ECAM_BUS_SHIFT;
+
+	rc = ecam_add_region(fd, 0, 0, 0,
+			(sb.st_size >> ECAM_BUS_SHIFT) - 1);
+
+	close(fd);
+
+	return rc;
+}
+
+/**
+ * Select the configuration access backend
+ *
+ * Recognized names are "pciaccess" (the default), "ecam" which maps the
+ * regions described by MCFG, and "ecam:<file>" which maps an image file.
+ */
+int32_t
+cfg_backend_init(const char *name)
+{
+
+	if ((name == NULL) || (strcmp(name, "pciaccess") == 0)) {
+		return 0;
+	}
+
+	if (strcmp(name, "ecam") == 0) {
+		return ecam_init_mcfg();
+	}
+
+	if (strncmp(name, "ecam:", 5) == 0) {
+		return ecam_init_file(name + 5);
+	}
+
+	return EINVAL;
+}
+
+void
+cfg_backend_fini(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < nregions; i++) {
+		munmap((void *)regions[i].base, regions[i].len);
+	}
+
+	free(regions);
+	regions = NULL;
+	nregions = 0;
+}
+
+/**
+ * Return the address of a device's configuration space or NULL if no
+ * ECAM region covers it
+ */
+static volatile uint8_t *
+ecam_cfg_base(const struct pci_device *pdev)
+{
+	uint32_t i;
+
+	for (i = 0; i < nregions; i++) {
+		struct ecam_region *r = &regions[i];
+
+		if ((r->segment == pdev->domain) &&
+				(pdev->bus >= r->start_bus) &&
+				(pdev->bus <= r->end_bus)) {
+			return r->base +
+				((size_t)(pdev->bus - r->start_bus) << ECAM_BUS_SHIFT) +
+				(pdev->dev << ECAM_DEV_SHIFT) +
+				(pdev->func << ECAM_FUNC_SHIFT);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Does the ECAM backend handle accesses to this device?
+ */
+int
+ecam_mapped(const struct pci_device *pdev)
+{
+
+	return (nregions != 0) && (ecam_cfg_base(pdev) != NULL);
+}
+
+int32_t
+ecam_read(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
+{
+	volatile uint8_t *cfg = ecam_cfg_base(pdev);
+
+	if (cfg == NULL) {
+		return ENODEV;
+	}
+
+	if ((width > ECAM_CFG_SIZE) || (off > ECAM_CFG_SIZE - width) ||
+			(off & (width - 1))) {
+		return EINVAL;
+	}
+
+	switch (width) {
+	case 1:
+		*((uint8_t *)v) = *(cfg + off);
+		break;
+	case 2:
+		*((uint16_t *)v) = *((volatile uint16_t *)(cfg + off));
+		break;
+	case 4:
+		*((uint32_t *)v) = *((volatile uint32_t *)(cfg + off));
+		break;
+	default:
+		return ENODEV;
+	}
+
+	return 0;
+}
+
+int32_t
+ecam_write(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
+{
+	volatile uint8_t *cfg = ecam_cfg_base(pdev);
+
+	if (cfg == NULL) {
+		return ENODEV;
+	}
+
+	if ((width > ECAM_CFG_SIZE) || (off > ECAM_CFG_SIZE - width) ||
+			(off & (width - 1))) {
+		return EINVAL;
+	}
+
+	switch (width) {
+	case 1:
+		*(cfg + off) = *((uint8_t *)v);
+		break;
+	case 2:
+		*((volatile uint16_t *)(cfg + off)) = *((uint16_t *)v);
+		break;
+	case 4:
+		*((volatile uint32_t *)(cfg + off)) = *((uint32_t *)v);
+		break;
+	default:
+		return ENODEV;
+	}
+
+	return 0;
+}
+
+/**
+ * Read a range of configuration space
+ *
+ * Uses aligned 32-bit loads where possible as some platforms do not
+ * support narrower ECAM accesses
+ */
+int32_t
+ecam_read_range(struct pci_device *pdev, uint32_t off, void *buf, uint32_t len,
+		uint32_t *nread)
+{
+	volatile uint8_t *cfg = ecam_cfg_base(pdev);
+	uint8_t *b = buf;
+	uint32_t i = 0;
+
+	*nread = 0;
+
+	if (cfg == NULL) {
+		return ENODEV;
+	}
+
+	if (off >= ECAM_CFG_SIZE) {
+		return EINVAL;
+	}
+
+	/* off + len may wrap */
+	if (len > ECAM_CFG_SIZE - off)
+		len = ECAM_CFG_SIZE - off;
+
+	while (i < len) {
+		if ((((off + i) & 3) == 0) && (len - i >= 4)) {
+			uint32_t v = *((volatile uint32_t *)(cfg + off + i));
+
+			memcpy(b + i, &v, sizeof(v));
+			i += 4;
+		} else {
+			b[i] = *(cfg + off + i);
+			i++;
+		}
+	}
+
+	*nread = len;
+
+	return 0;
+}
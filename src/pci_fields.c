@@ -0,0 +1,405 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Field projection for devlist and tree (--fields)
+ *
+ * Only the requested fields are computed. Each device has a record which
+ * evaluates a field the first time it is needed, so sorting by one field
+ * and displaying others costs one evaluation per field per device.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <unistd.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern void pci_device_get_names(const struct pci_device *pdev,
+		const char **cname, const char **vname, const char **dname);
+
+#define SYSFS_PCI_DEVICES	"/sys/bus/pci/devices"
+
+#define MAX_FIELDS	32
+
+enum field_id {
+	F_BDF,
+	F_VENDORID,
+	F_DEVICEID,
+	F_SUBVENDORID,
+	F_SUBDEVICEID,
+	F_CLASS,
+	F_REVISION,
+	F_CLASSNAME,
+	F_VENDORNAME,
+	F_DEVNAME,
+	F_NUMA,
+	F_DRIVER,
+	F_LINK,
+	F_SPEED,
+	F_WIDTH,
+	F_NFIELDS
+};
+
+struct field_val {
+	int64_t num;		/* numeric value or sort key */
+	const char *str;	/* string value or NULL for numeric fields */
+	char buf[64];
+};
+
+struct field_rec {
+	struct pci_device *pdev;
+	uint32_t valid;		/* bitmap of evaluated fields */
+	struct field_val v[F_NFIELDS];
+};
+
+struct fields {
+	uint32_t n;
+	enum field_id id[MAX_FIELDS];
+	int32_t sort;
+};
+
+typedef void (*field_fcn_t)(struct field_rec *r, struct field_val *v);
+
+static void
+get_bdf(struct field_rec *r, struct field_val *v)
+{
+	struct pci_device *pdev = r->pdev;
+
+	snprintf(v->buf, sizeof(v->buf), "%04x:%02x:%02x.%u",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+	v->str = v->buf;
+	v->num = ((int64_t)pdev->domain << 16) | (pdev->bus << 8) |
+		(pdev->dev << 3) | pdev->func;
+}
+
+static void
+get_vendorid(struct field_rec *r, struct field_val *v)
+{
+
+	v->num = r->pdev->vendor_id;
+}
+
+static void
+get_deviceid(struct field_rec *r, struct field_val *v)
+{
+
+	v->num = r->pdev->device_id;
+}
+
+static void
+get_subvendorid(struct field_rec *r, struct field_val *v)
+{
+
+	v->num = r->pdev->subvendor_id;
+}
+
+static void
+get_subdeviceid(struct field_rec *r, struct field_val *v)
+{
+
+	v->num = r->pdev->subdevice_id;
+}
+
+static void
+get_class(struct field_rec *r, struct field_val *v)
+{
+
+	v->num = r->pdev->device_class;
+}
+
+static void
+get_revision(struct field_rec *r, struct field_val *v)
+{
+
+	v->num = r->pdev->revision;
+}
+
+static void
+get_names(struct field_rec *r, struct field_val *v)
+{
+	const char *cname = NULL, *vname = NULL, *dname = NULL;
+
+	pci_device_get_names(r->pdev, &cname, &vname, &dname);
+
+	if (v == &r->v[F_CLASSNAME])
+		v->str = cname;
+	else if (v == &r->v[F_VENDORNAME])
+		v->str = vname;
+	else
+		v->str = dname;
+
+	if (v->str == NULL)
+		v->str = "";
+}
+
+static void
+sysfs_path(struct pci_device *pdev, const char *attr, char *path, size_t len)
+{
+
+	snprintf(path, len, SYSFS_PCI_DEVICES "/%04x:%02x:%02x.%u/%s",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func, attr);
+}
+
+static void
+get_numa(struct field_rec *r, struct field_val *v)
+{
+	char path[128];
+	FILE *f;
+
+	v->num = -1;
+
+	sysfs_path(r->pdev, "numa_node", path, sizeof(path));
+	f = fopen(path, "r");
+	if (f != NULL) {
+		if (fscanf(f, "%jd", (intmax_t *)&v->num) != 1)
+			v->num = -1;
+		fclose(f);
+	}
+}
+
+static void
+get_driver(struct field_rec *r, struct field_val *v)
+{
+	char path[128];
+	ssize_t len;
+
+	v->str = "-";
+
+	sysfs_path(r->pdev, "driver", path, sizeof(path));
+	len = readlink(path, v->buf, sizeof(v->buf) - 1);
+	if (len > 0) {
+		char *slash;
+
+		v->buf[len] = '\0';
+		slash = strrchr(v->buf, '/');
+		v->str = slash ? slash + 1 : v->buf;
+	}
+}
+
+/* Link speed and width come from LNKSTA and share one evaluation */
+static void
+get_link(struct field_rec *r, struct field_val *v)
+{
+	struct field_val *link = &r->v[F_LINK];
+	uint16_t lnksta = 0;
+	uint32_t cap;
+
+	r->v[F_SPEED].num = 0;
+	r->v[F_WIDTH].num = 0;
+	link->num = 0;
+	link->str = "-";
+
+	cap = pci_find_cap(r->pdev, PCI_CAP_ID_EXP);
+	if ((cap == 0) || read_cfg(r->pdev, cap + PCIE_LNKSTA, &lnksta, 2) ||
+			(PCIE_LNKSTA_WIDTH(lnksta) == 0))
+		goto done;
+
+	r->v[F_SPEED].num = PCIE_LNKSTA_SPEED(lnksta);
+	r->v[F_WIDTH].num = PCIE_LNKSTA_WIDTH(lnksta);
+	link->num = (r->v[F_SPEED].num << 8) | r->v[F_WIDTH].num;
+	snprintf(link->buf, sizeof(link->buf), "Gen%jd-x%jd",
+			(intmax_t)r->v[F_SPEED].num, (intmax_t)r->v[F_WIDTH].num);
+	link->str = link->buf;
+
+done:
+	r->valid |= (1 << F_LINK) | (1 << F_SPEED) | (1 << F_WIDTH);
+}
+
+static struct field_def {
+	const char *name;
+	const char *fmt;
+	field_fcn_t fcn;
+} field_defs[F_NFIELDS] = {
+	[F_BDF]         = { "bdf",         "%s",   get_bdf },
+	[F_VENDORID]    = { "vendorid",    "%04x", get_vendorid },
+	[F_DEVICEID]    = { "deviceid",    "%04x", get_deviceid },
+	[F_SUBVENDORID] = { "subvendorid", "%04x", get_subvendorid },
+	[F_SUBDEVICEID] = { "subdeviceid", "%04x", get_subdeviceid },
+	[F_CLASS]       = { "class",       "%06x", get_class },
+	[F_REVISION]    = { "revision",    "%02x", get_revision },
+	[F_CLASSNAME]   = { "classname",   "%s",   get_names },
+	[F_VENDORNAME]  = { "vendorname",  "%s",   get_names },
+	[F_DEVNAME]     = { "devname",     "%s",   get_names },
+	[F_NUMA]        = { "numa",        "%d",   get_numa },
+	[F_DRIVER]      = { "driver",      "%s",   get_driver },
+	[F_LINK]        = { "link",        "%s",   get_link },
+	[F_SPEED]       = { "speed",       "%d",   get_link },
+	[F_WIDTH]       = { "width",       "%d",   get_link },
+};
+
+static int32_t
+field_lookup(const char *name)
+{
+	int32_t i;
+
+	for (i = 0; i < F_NFIELDS; i++) {
+		if (strcmp(field_defs[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Evaluate a field of a device record if it hasn't been already
+ */
+static struct field_val *
+field_get(struct field_rec *r, enum field_id id)
+{
+
+	if (!(r->valid & (1 << id))) {
+		field_defs[id].fcn(r, &r->v[id]);
+		r->valid |= 1 << id;
+	}
+
+	return &r->v[id];
+}
+
+/**
+ * Parse a comma separated list of field names and an optional sort field
+ *
+ * Returns NULL if a name isn't recognized
+ */
+struct fields *
+fields_parse(const char *spec, const char *sort)
+{
+	struct fields *f;
+	char *s, *tok, *save = NULL;
+
+	f = calloc(1, sizeof(struct fields));
+	s = strdup(spec);
+	if ((f == NULL) || (s == NULL))
+		err(1, "fields");
+
+	f->sort = -1;
+
+	for (tok = strtok_r(s, ",", &save); tok != NULL;
+			tok = strtok_r(NULL, ",", &save)) {
+		int32_t id = field_lookup(tok);
+
+		if ((id < 0) || (f->n == MAX_FIELDS)) {
+			warnx("Unknown field '%s'", tok);
+			goto fail;
+		}
+
+		f->id[f->n++] = id;
+	}
+
+	if (sort != NULL) {
+		f->sort = field_lookup(sort);
+		if (f->sort < 0) {
+			warnx("Unknown sort field '%s'", sort);
+			goto fail;
+		}
+	}
+
+	free(s);
+
+	return f;
+
+fail:
+	free(s);
+	free(f);
+	return NULL;
+}
+
+struct field_rec *
+fields_rec(struct pci_device *pdev)
+{
+	struct field_rec *r;
+
+	r = calloc(1, sizeof(struct field_rec));
+	if (r == NULL)
+		err(1, "fields");
+
+	r->pdev = pdev;
+
+	return r;
+}
+
+struct pci_device *
+fields_rec_device(struct field_rec *r)
+{
+
+	return r->pdev;
+}
+
+static enum field_id sort_id;
+
+static int
+rec_cmp(const void *a, const void *b)
+{
+	struct field_val *va, *vb;
+
+	va = field_get(*(struct field_rec **)a, sort_id);
+	vb = field_get(*(struct field_rec **)b, sort_id);
+
+	if ((va->str != NULL) && (vb->str != NULL) && (sort_id != F_BDF))
+		return strcmp(va->str, vb->str);
+
+	return va->num < vb->num ? -1 : va->num > vb->num;
+}
+
+/**
+ * Sort device records by the sort field, if one was given
+ */
+void
+fields_sort(struct fields *f, struct field_rec **recs, uint32_t n)
+{
+
+	if (f->sort < 0)
+		return;
+
+	sort_id = f->sort;
+	qsort(recs, n, sizeof(struct field_rec *), rec_cmp);
+}
+
+void
+fields_emit(struct fields *f, struct field_rec *r)
+{
+	char fmt[64];
+	uint32_t i;
+
+	for (i = 0; i < f->n; i++) {
+		const struct field_def *d = &field_defs[f->id[i]];
+		struct field_val *v = field_get(r, f->id[i]);
+
+		snprintf(fmt, sizeof(fmt), "%s{%s:%s/%s}", i ? " " : "",
+				f->id[i] == F_BDF ? "k" : "", d->name, d->fmt);
+
+		if (strcmp(d->fmt, "%s") == 0)
+			xo_emit(fmt, v->str);
+		else
+			xo_emit(fmt, (int)v->num);
+	}
+
+	xo_emit("\n");
+}
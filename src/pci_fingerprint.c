@@ -0,0 +1,653 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Configuration fingerprints
+ *
+ * Hashes the identity and the performance relevant configuration of each
+ * device, and combines the hashes of the devices below each bridge into
+ * a hash of the bridge's subtree (a Merkle tree). Comparing against a
+ * saved baseline starts at the root and only descends into subtrees whose
+ * hash differs, so an unchanged fabric costs a single comparison and a
+ * changed one reports just the subtrees which changed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern void usage(void);
+extern void tree_build(void);
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+extern void tree_free(void);
+extern uint32_t work_default_threads(void);
+extern void work_run(uint32_t n, uint32_t nthreads,
+		void (*fn)(void *arg, uint32_t idx), void *arg);
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x00000100000001b3ULL
+
+/* Bound the capability walks in case of loops in broken lists */
+#define MAX_CAPS	48
+#define MAX_EXT_CAPS	((PCI_CFG_SIZE_EXT - PCI_CFG_SIZE) / 8)
+
+#define NO_NODE		-1
+
+static struct option opts[] = {
+	{ "baseline", required_argument, NULL, 'b'},
+	{ "jobs", required_argument, NULL, 'j'},
+	{ "write", required_argument, NULL, 'w'},
+	{ NULL, 0, NULL, 0 }
+};
+
+/* A device in either the current or the baseline hierarchy */
+struct fp_node {
+	struct pci_device *pdev;	/* NULL for baseline nodes */
+	uint16_t domain;
+	uint8_t bus;
+	uint8_t dev;
+	uint8_t func;
+	int32_t parent;
+	int32_t child;			/* first child in address order */
+	int32_t sibling;
+	uint64_t dev_hash;
+	uint64_t tree_hash;
+	uint32_t ndevs;			/* devices in the subtree */
+};
+
+struct fp_tree {
+	struct fp_node *nodes;
+	uint32_t n;
+	int32_t first;			/* first device without a parent */
+	uint64_t root_hash;
+};
+
+static uint64_t
+fnv1a(uint64_t h, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--) {
+		h ^= *p++;
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+static uint64_t
+hash_cfg(uint64_t h, struct pci_device *pdev, uint32_t off, uint32_t width,
+		uint32_t mask)
+{
+	uint32_t v = 0;
+
+	read_cfg(pdev, off, &v, width);
+	v &= mask;
+
+	return fnv1a(h, &v, sizeof(v));
+}
+
+/**
+ * Hash the IDs of the standard and extended capabilities in list order
+ */
+static uint64_t
+hash_caps(uint64_t h, struct pci_device *pdev)
+{
+	uint16_t status = 0;
+	uint8_t ptr = 0;
+	uint32_t n, eptr = PCI_CFG_SIZE;
+
+	read_cfg(pdev, PCI_STATUS, &status, 2);
+	if (status & PCI_STATUS_CAP_LIST)
+		read_cfg(pdev, PCI_CAP_PTR, &ptr, 1);
+
+	for (n = 0; (ptr >= 0x40) && (n < MAX_CAPS); n++) {
+		uint16_t hdr = 0;
+
+		ptr &= ~3;
+		if (read_cfg(pdev, ptr, &hdr, 2))
+			break;
+
+		h = fnv1a(h, &hdr, 1);
+		ptr = hdr >> 8;
+	}
+
+	if (pci_find_cap(pdev, PCI_CAP_ID_EXP) == 0)
+		return h;
+
+	for (n = 0; (eptr >= PCI_CFG_SIZE) && (n < MAX_EXT_CAPS); n++) {
+		uint32_t hdr = 0;
+
+		if (read_cfg(pdev, eptr, &hdr, 4) || (hdr == 0) ||
+				(hdr == UINT32_MAX))
+			break;
+
+		h = fnv1a(h, &hdr, 2);
+		eptr = (hdr >> 20) & 0xffc;
+	}
+
+	return h;
+}
+
+/**
+ * Hash a device's address, IDs, bus numbers, BAR sizes, capability set,
+ * and PCI Express control and negotiated link settings
+ *
+ * Values which change without the configuration changing, such as
+ * status bits and the addresses assigned to BARs, are left out.
+ */
+static void
+fp_hash_dev(void *arg, uint32_t idx)
+{
+	struct fp_node *node = &((struct fp_node *)arg)[idx];
+	struct pci_device *pdev = node->pdev;
+	uint64_t h = FNV_OFFSET;
+	uint32_t cap, i;
+	uint8_t hdr = 0;
+
+	h = fnv1a(h, &pdev->domain, sizeof(pdev->domain));
+	h = fnv1a(h, &pdev->bus, sizeof(pdev->bus));
+	h = fnv1a(h, &pdev->dev, sizeof(pdev->dev));
+	h = fnv1a(h, &pdev->func, sizeof(pdev->func));
+	h = fnv1a(h, &pdev->vendor_id, sizeof(pdev->vendor_id));
+	h = fnv1a(h, &pdev->device_id, sizeof(pdev->device_id));
+	h = fnv1a(h, &pdev->subvendor_id, sizeof(pdev->subvendor_id));
+	h = fnv1a(h, &pdev->subdevice_id, sizeof(pdev->subdevice_id));
+	h = fnv1a(h, &pdev->device_class, sizeof(pdev->device_class));
+	h = fnv1a(h, &pdev->revision, sizeof(pdev->revision));
+
+	read_cfg(pdev, PCI_HEADER_TYPE, &hdr, 1);
+	hdr &= PCI_HEADER_TYPE_MASK;
+	h = fnv1a(h, &hdr, sizeof(hdr));
+
+	if (hdr == PCI_HEADER_TYPE_BRIDGE)
+		h = hash_cfg(h, pdev, PCI_PRIMARY_BUS, 4, PCI_BUS_NUMBERS_MASK);
+
+	if (pci_device_probe(pdev) == 0) {
+		for (i = 0; i < 6; i++) {
+			uint64_t size = pdev->regions[i].size;
+
+			h = fnv1a(h, &size, sizeof(size));
+		}
+	}
+
+	h = hash_caps(h, pdev);
+
+	cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+	if (cap != 0) {
+		h = hash_cfg(h, pdev, cap + PCIE_DEVCTL, 2, UINT32_MAX);
+		h = hash_cfg(h, pdev, cap + PCIE_DEVCTL2, 2, UINT32_MAX);
+		h = hash_cfg(h, pdev, cap + PCIE_LNKCTL, 2,
+				PCIE_LNKCTL_ASPM_L0S | PCIE_LNKCTL_ASPM_L1);
+		h = hash_cfg(h, pdev, cap + PCIE_LNKSTA, 2,
+				PCIE_LNKSTA_SPEED(UINT32_MAX) |
+				(PCIE_LNKSTA_WIDTH(UINT32_MAX) << 4));
+	}
+
+	node->dev_hash = h;
+}
+
+static int
+fp_node_cmp(const void *a, const void *b)
+{
+	const struct fp_node *na = a, *nb = b;
+
+	if (na->domain != nb->domain)
+		return na->domain < nb->domain ? -1 : 1;
+	if (na->bus != nb->bus)
+		return na->bus < nb->bus ? -1 : 1;
+	if (na->dev != nb->dev)
+		return na->dev < nb->dev ? -1 : 1;
+	if (na->func != nb->func)
+		return na->func < nb->func ? -1 : 1;
+
+	return 0;
+}
+
+static int32_t
+fp_find(const struct fp_tree *t, uint16_t domain, uint8_t bus, uint8_t dev,
+		uint8_t func)
+{
+	struct fp_node key, *node;
+
+	key.domain = domain;
+	key.bus = bus;
+	key.dev = dev;
+	key.func = func;
+
+	node = bsearch(&key, t->nodes, t->n, sizeof(struct fp_node),
+			fp_node_cmp);
+
+	return node == NULL ? NO_NODE : node - t->nodes;
+}
+
+static uint64_t
+fp_subtree(struct fp_tree *t, int32_t i)
+{
+	struct fp_node *node = &t->nodes[i];
+	uint64_t h = fnv1a(FNV_OFFSET, &node->dev_hash, sizeof(uint64_t));
+	int32_t c;
+
+	node->ndevs = 1;
+
+	for (c = node->child; c != NO_NODE; c = t->nodes[c].sibling) {
+		fp_subtree(t, c);
+		h = fnv1a(h, &t->nodes[c].tree_hash, sizeof(uint64_t));
+		node->ndevs += t->nodes[c].ndevs;
+	}
+
+	node->tree_hash = h;
+
+	return h;
+}
+
+/**
+ * Link each node to its children in address order and compute the
+ * subtree and root hashes. Nodes must be sorted and have parents set.
+ */
+static void
+fp_link(struct fp_tree *t)
+{
+	uint64_t h = FNV_OFFSET;
+	int32_t i;
+
+	t->first = NO_NODE;
+
+	for (i = 0; i < (int32_t)t->n; i++)
+		t->nodes[i].child = t->nodes[i].sibling = NO_NODE;
+
+	for (i = t->n - 1; i >= 0; i--) {
+		int32_t *head = t->nodes[i].parent == NO_NODE ? &t->first :
+			&t->nodes[t->nodes[i].parent].child;
+
+		t->nodes[i].sibling = *head;
+		*head = i;
+	}
+
+	for (i = t->first; i != NO_NODE; i = t->nodes[i].sibling) {
+		uint64_t sub = fp_subtree(t, i);
+
+		h = fnv1a(h, &sub, sizeof(sub));
+	}
+
+	t->root_hash = h;
+}
+
+static int
+fp_scan(struct fp_tree *t, uint32_t nthreads)
+{
+	struct pci_device_iterator *iter;
+	struct pci_device *pdev;
+	struct fp_node *nodes;
+	uint32_t i;
+
+	memset(t, 0, sizeof(*t));
+
+	iter = pci_slot_match_iterator_create(NULL);
+
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		nodes = realloc(t->nodes, (t->n + 1) * sizeof(struct fp_node));
+		if (nodes == NULL) {
+			xo_warn("fingerprint");
+			pci_iterator_destroy(iter);
+			return -1;
+		}
+		t->nodes = nodes;
+
+		memset(&nodes[t->n], 0, sizeof(struct fp_node));
+		nodes[t->n].pdev = pdev;
+		nodes[t->n].domain = pdev->domain;
+		nodes[t->n].bus = pdev->bus;
+		nodes[t->n].dev = pdev->dev;
+		nodes[t->n].func = pdev->func;
+		t->n++;
+	}
+
+	pci_iterator_destroy(iter);
+
+	qsort(t->nodes, t->n, sizeof(struct fp_node), fp_node_cmp);
+
+	for (i = 0; i < t->n; i++) {
+		struct pci_device *p = tree_parent(t->nodes[i].pdev);
+
+		t->nodes[i].parent = p == NULL ? NO_NODE :
+			fp_find(t, p->domain, p->bus, p->dev, p->func);
+	}
+
+	work_run(t->n, nthreads, fp_hash_dev, t->nodes);
+
+	fp_link(t);
+
+	return 0;
+}
+
+/**
+ * Read a baseline of "<bdf> <parent bdf or -> <device hash>" lines
+ */
+static int
+fp_load(struct fp_tree *t, const char *path)
+{
+	struct parent {
+		unsigned int domain, bus, dev, func;
+		int valid;
+	} *parents = NULL, *pp;
+	struct fp_node *nodes;
+	char line[128];
+	FILE *f;
+	uint32_t i;
+	int rc = 0;
+
+	memset(t, 0, sizeof(*t));
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		xo_warn("%s", path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned int dom, bus, dev, func;
+		uintmax_t hash;
+		char pstr[32];
+
+		if (sscanf(line, "%x:%x:%x.%u %31s %jx", &dom, &bus, &dev,
+				&func, pstr, &hash) != 6)
+			continue;
+
+		nodes = realloc(t->nodes, (t->n + 1) * sizeof(struct fp_node));
+		pp = realloc(parents, (t->n + 1) * sizeof(struct parent));
+		if (nodes != NULL)
+			t->nodes = nodes;
+		if (pp != NULL)
+			parents = pp;
+		if ((nodes == NULL) || (pp == NULL)) {
+			xo_warn("fingerprint");
+			rc = -1;
+			break;
+		}
+
+		memset(&nodes[t->n], 0, sizeof(struct fp_node));
+		nodes[t->n].domain = dom;
+		nodes[t->n].bus = bus;
+		nodes[t->n].dev = dev;
+		nodes[t->n].func = func;
+		nodes[t->n].dev_hash = hash;
+
+		pp = &parents[t->n];
+		pp->valid = sscanf(pstr, "%x:%x:%x.%u", &pp->domain, &pp->bus,
+				&pp->dev, &pp->func) == 4;
+
+		t->n++;
+	}
+
+	fclose(f);
+
+	if (rc == 0) {
+		/*
+		 * Sorting moves the nodes, so remember the line each came from
+		 * to find its parent afterwards. fp_link() resets the links.
+		 */
+		for (i = 0; i < t->n; i++) {
+			t->nodes[i].parent = NO_NODE;
+			t->nodes[i].child = i;
+		}
+
+		qsort(t->nodes, t->n, sizeof(struct fp_node), fp_node_cmp);
+
+		for (i = 0; i < t->n; i++) {
+			pp = &parents[t->nodes[i].child];
+			if (pp->valid)
+				t->nodes[i].parent = fp_find(t, pp->domain,
+						pp->bus, pp->dev, pp->func);
+		}
+
+		fp_link(t);
+	}
+
+	free(parents);
+
+	return rc;
+}
+
+/**
+ * Write the current hierarchy as a baseline
+ */
+static void
+fp_save(const struct fp_tree *t, const char *path)
+{
+	char *tmp;
+	FILE *out;
+	uint32_t i;
+	int fd;
+
+	tmp = malloc(strlen(path) + 8);
+	if (tmp == NULL) {
+		xo_warn("%s", path);
+		return;
+	}
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		xo_warn("%s", tmp);
+		free(tmp);
+		return;
+	}
+
+	out = fdopen(fd, "w");
+	if (out == NULL) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+
+	for (i = 0; i < t->n; i++) {
+		const struct fp_node *n = &t->nodes[i];
+
+		fprintf(out, "%04x:%02x:%02x.%u ", n->domain, n->bus, n->dev,
+				n->func);
+		if (n->parent == NO_NODE) {
+			fprintf(out, "-");
+		} else {
+			const struct fp_node *p = &t->nodes[n->parent];
+
+			fprintf(out, "%04x:%02x:%02x.%u", p->domain, p->bus,
+					p->dev, p->func);
+		}
+		fprintf(out, " %016jx\n", (uintmax_t)n->dev_hash);
+	}
+
+	if (fclose(out) || rename(tmp, path)) {
+		xo_warn("%s", path);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+static void
+fp_emit_change(const char *change, const struct fp_node *n)
+{
+
+	xo_open_instance("change");
+	xo_emit("{:change/%s} {k:bdf/%04x:%02x:%02x.%u}", change,
+			n->domain, n->bus, n->dev, n->func);
+	if (n->ndevs > 1)
+		xo_emit(" ({:devices/%u} devices)", n->ndevs);
+	xo_emit("\n");
+	xo_close_instance("change");
+}
+
+/**
+ * Compare two lists of sibling subtrees, descending only into subtrees
+ * whose hashes differ
+ */
+static uint32_t
+fp_diff(const struct fp_tree *cur, int32_t c, const struct fp_tree *base,
+		int32_t b)
+{
+	uint32_t nchanges = 0;
+
+	while ((c != NO_NODE) || (b != NO_NODE)) {
+		const struct fp_node *cn = c == NO_NODE ? NULL : &cur->nodes[c];
+		const struct fp_node *bn = b == NO_NODE ? NULL : &base->nodes[b];
+		int cmp;
+
+		if (cn == NULL)
+			cmp = 1;
+		else if (bn == NULL)
+			cmp = -1;
+		else
+			cmp = fp_node_cmp(cn, bn);
+
+		if (cmp < 0) {
+			fp_emit_change("added", cn);
+			nchanges++;
+			c = cn->sibling;
+			continue;
+		}
+
+		if (cmp > 0) {
+			fp_emit_change("removed", bn);
+			nchanges++;
+			b = bn->sibling;
+			continue;
+		}
+
+		if (cn->tree_hash != bn->tree_hash) {
+			if (cn->dev_hash != bn->dev_hash) {
+				fp_emit_change("changed", cn);
+				nchanges++;
+			}
+			nchanges += fp_diff(cur, cn->child, base, bn->child);
+		}
+
+		c = cn->sibling;
+		b = bn->sibling;
+	}
+
+	return nchanges;
+}
+
+/**
+ * Fingerprint the configuration of all devices and optionally compare it
+ * to or save it as a baseline
+ */
+void
+fingerprint(int argc, char *argv[])
+{
+	struct fp_tree cur, base;
+	const char *baseline = NULL, *out = NULL;
+	uint32_t nthreads = 0, i;
+	unsigned long n;
+	char *end;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "b:j:w:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'j':
+			n = strtoul(optarg, &end, 0);
+			if ((end == optarg) || (*end != '\0') || (n == 0) ||
+					(n > UINT32_MAX)) {
+				usage();
+				return;
+			}
+			nthreads = n;
+			break;
+		case 'w':
+			out = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	if (nthreads == 0)
+		nthreads = work_default_threads();
+
+	tree_build();
+
+	if (fp_scan(&cur, nthreads) != 0)
+		goto out;
+
+	if (baseline != NULL) {
+		uint32_t nchanges = 0;
+
+		if (fp_load(&base, baseline) != 0) {
+			free(base.nodes);
+			goto out;
+		}
+
+		xo_open_list("change");
+		if (cur.root_hash != base.root_hash)
+			nchanges = fp_diff(&cur, cur.first, &base, base.first);
+		xo_close_list("change");
+
+		xo_emit("{:root-hash/%016jx} {:status/%s}",
+				(uintmax_t)cur.root_hash,
+				nchanges ? "changed" : "unchanged");
+		if (nchanges)
+			xo_emit(" ({:changes/%u} subtrees)", nchanges);
+		xo_emit("\n");
+
+		free(base.nodes);
+	} else {
+		xo_open_list("device");
+		for (i = 0; i < cur.n; i++) {
+			struct fp_node *n = &cur.nodes[i];
+
+			xo_open_instance("device");
+			xo_emit("{k:bdf/%04x:%02x:%02x.%u} {:hash/%016jx}",
+					n->domain, n->bus, n->dev, n->func,
+					(uintmax_t)n->dev_hash);
+			if (n->child != NO_NODE)
+				xo_emit(" subtree {:subtree-hash/%016jx}",
+						(uintmax_t)n->tree_hash);
+			xo_emit("\n");
+			xo_close_instance("device");
+		}
+		xo_close_list("device");
+
+		xo_emit("{:root-hash/%016jx}\n", (uintmax_t)cur.root_hash);
+	}
+
+	if (out != NULL)
+		fp_save(&cur, out);
+
+out:
+	free(cur.nodes);
+	tree_free();
+}
@@ -0,0 +1,807 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Fleet snapshots
+ *
+ * "capture" writes a compact binary snapshot of a host's devices. "query"
+ * memory maps a directory of snapshots from many hosts in parallel, loads
+ * them into one column per field, and filters or counts the rows.
+ *
+ * Snapshots use the byte order of the host which captured them.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern void usage(void);
+extern uint32_t work_default_threads(void);
+extern void work_run(uint32_t n, uint32_t nthreads,
+		void (*fn)(void *arg, uint32_t idx), void *arg);
+
+#define FLEET_MAGIC		"PCIFLEET"
+#define FLEET_VERSION		1
+#define FLEET_HOST_LEN		64
+
+#define FLEET_MAX_TERMS		16
+#define FLEET_MAX_ALTS		4
+#define FLEET_MAX_GROUP		4
+
+struct fleet_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t nrec;
+	uint32_t reserved;
+	uint64_t time;		/* seconds since the Epoch */
+	char host[FLEET_HOST_LEN];
+};
+
+/* Later versions may only append fields */
+struct fleet_rec {
+	uint32_t bdf;		/* domain << 16 | bus << 8 | devfn */
+	uint32_t class;
+	uint16_t vendor;
+	uint16_t device;
+	uint16_t subvendor;
+	uint16_t subdevice;
+	uint8_t revision;
+	uint8_t speed;		/* current link speed and width */
+	uint8_t width;
+	uint8_t max_speed;	/* link capabilities */
+	uint8_t max_width;
+	uint8_t reserved[3];
+};
+
+enum fleet_col {
+	COL_HOST,
+	COL_BDF,
+	COL_VENDOR,
+	COL_DEVICE,
+	COL_SUBVENDOR,
+	COL_SUBDEVICE,
+	COL_CLASS,
+	COL_REVISION,
+	COL_SPEED,
+	COL_WIDTH,
+	COL_MAX_SPEED,
+	COL_MAX_WIDTH,
+	COL_NCOLS
+};
+
+static const struct fleet_col_def {
+	const char *name;
+	int base;		/* for parsing values */
+	int digits;		/* of hex values */
+} col_def[COL_NCOLS] = {
+	[COL_HOST] =		{ "host", 0, 0 },
+	[COL_BDF] =		{ "bdf", 16, 0 },
+	[COL_VENDOR] =		{ "vendor", 16, 4 },
+	[COL_DEVICE] =		{ "device", 16, 4 },
+	[COL_SUBVENDOR] =	{ "subvendor", 16, 4 },
+	[COL_SUBDEVICE] =	{ "subdevice", 16, 4 },
+	[COL_CLASS] =		{ "class", 16, 6 },
+	[COL_REVISION] =	{ "revision", 16, 2 },
+	[COL_SPEED] =		{ "speed", 10, 0 },
+	[COL_WIDTH] =		{ "width", 10, 0 },
+	[COL_MAX_SPEED] =	{ "maxspeed", 10, 0 },
+	[COL_MAX_WIDTH] =	{ "maxwidth", 10, 0 },
+};
+
+enum fleet_op { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+
+struct fleet_cond {
+	enum fleet_col col;
+	enum fleet_op op;
+	uint32_t value;
+	uint32_t mask;		/* for class prefixes */
+	const char *str;	/* for host names */
+};
+
+/* A term is true if any of its alternatives (separated by '|') is */
+struct fleet_term {
+	struct fleet_cond alt[FLEET_MAX_ALTS];
+	uint32_t nalt;
+};
+
+struct fleet_file {
+	char path[PATH_MAX];
+	void *map;
+	size_t len;
+	uint32_t nrec;
+	uint32_t first;		/* row of the first record */
+};
+
+struct fleet {
+	struct fleet_file *files;
+	uint32_t nfiles;
+	char **hosts;		/* indexed by file */
+	uint32_t *col[COL_NCOLS];
+	uint32_t nrows;
+};
+
+static struct option opts[] = {
+	{ "count", required_argument, NULL, 'c'},
+	{ "jobs", required_argument, NULL, 'j'},
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * Write a snapshot of this host's devices
+ */
+static void
+fleet_capture(const char *path)
+{
+	struct pci_device_iterator *iter;
+	struct pci_device *pdev;
+	struct fleet_hdr hdr;
+	struct fleet_rec rec;
+	char tmp[PATH_MAX];
+	FILE *f;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FLEET_MAGIC, sizeof(hdr.magic));
+	hdr.version = FLEET_VERSION;
+	hdr.rec_size = sizeof(struct fleet_rec);
+	hdr.time = time(NULL);
+	gethostname(hdr.host, sizeof(hdr.host) - 1);
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if ((fd < 0) || ((f = fdopen(fd, "w")) == NULL))
+		err(1, "%s", tmp);
+
+	/* The record count is filled in once known */
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	iter = pci_slot_match_iterator_create(NULL);
+
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		uint32_t cap, lnkcap = 0;
+		uint16_t lnksta = 0;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.bdf = (pdev->domain << 16) | (pdev->bus << 8) |
+			(pdev->dev << 3) | pdev->func;
+		rec.class = pdev->device_class;
+		rec.vendor = pdev->vendor_id;
+		rec.device = pdev->device_id;
+		rec.subvendor = pdev->subvendor_id;
+		rec.subdevice = pdev->subdevice_id;
+		rec.revision = pdev->revision;
+
+		cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+		if (cap != 0) {
+			read_cfg(pdev, cap + PCIE_LNKSTA, &lnksta, 2);
+			read_cfg(pdev, cap + PCIE_LNKCAP, &lnkcap, 4);
+			rec.speed = PCIE_LNKSTA_SPEED(lnksta);
+			rec.width = PCIE_LNKSTA_WIDTH(lnksta);
+			rec.max_speed = PCIE_LNKCAP_SPEED(lnkcap);
+			rec.max_width = PCIE_LNKCAP_WIDTH(lnkcap);
+		}
+
+		fwrite(&rec, sizeof(rec), 1, f);
+		hdr.nrec++;
+	}
+
+	pci_iterator_destroy(iter);
+
+	rewind(f);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	if (ferror(f)) {
+		fclose(f);
+		unlink(tmp);
+		errx(1, "%s: write failed", tmp);
+	}
+
+	if (fclose(f) || rename(tmp, path)) {
+		unlink(tmp);
+		err(1, "%s", path);
+	}
+
+	xo_emit("{:records/%u} {L:devices written to} {:file/%s}\n",
+			hdr.nrec, path);
+}
+
+/**
+ * Map a snapshot and check its header
+ */
+static void
+fleet_map(void *arg, uint32_t idx)
+{
+	struct fleet_file *ff = &((struct fleet_file *)arg)[idx];
+	const struct fleet_hdr *hdr;
+	struct stat sb;
+	int fd;
+
+	fd = open(ff->path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &sb) || (sb.st_size < (off_t)sizeof(struct fleet_hdr))) {
+		close(fd);
+		return;
+	}
+
+	ff->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ff->map == MAP_FAILED) {
+		ff->map = NULL;
+		return;
+	}
+
+	ff->len = sb.st_size;
+	hdr = ff->map;
+
+	if (memcmp(hdr->magic, FLEET_MAGIC, sizeof(hdr->magic)) ||
+			(hdr->version < FLEET_VERSION) ||
+			(hdr->rec_size < sizeof(struct fleet_rec)) ||
+			(sizeof(*hdr) + (uint64_t)hdr->nrec * hdr->rec_size > ff->len)) {
+		munmap(ff->map, ff->len);
+		ff->map = NULL;
+		return;
+	}
+
+	ff->nrec = hdr->nrec;
+}
+
+/**
+ * Copy the records of a snapshot into the columns
+ */
+static void
+fleet_fill(void *arg, uint32_t idx)
+{
+	struct fleet *fl = arg;
+	struct fleet_file *ff = &fl->files[idx];
+	const struct fleet_hdr *hdr = ff->map;
+	const uint8_t *p;
+	uint32_t i, row;
+
+	if (hdr == NULL)
+		return;
+
+	p = (const uint8_t *)(hdr + 1);
+
+	for (i = 0; i < ff->nrec; i++, p += hdr->rec_size) {
+		const struct fleet_rec *r = (const struct fleet_rec *)p;
+
+		row = ff->first + i;
+		fl->col[COL_HOST][row] = idx;
+		fl->col[COL_BDF][row] = r->bdf;
+		fl->col[COL_VENDOR][row] = r->vendor;
+		fl->col[COL_DEVICE][row] = r->device;
+		fl->col[COL_SUBVENDOR][row] = r->subvendor;
+		fl->col[COL_SUBDEVICE][row] = r->subdevice;
+		fl->col[COL_CLASS][row] = r->class;
+		fl->col[COL_REVISION][row] = r->revision;
+		fl->col[COL_SPEED][row] = r->speed;
+		fl->col[COL_WIDTH][row] = r->width;
+		fl->col[COL_MAX_SPEED][row] = r->max_speed;
+		fl->col[COL_MAX_WIDTH][row] = r->max_width;
+	}
+
+	fl->hosts[idx] = strndup(hdr->host, FLEET_HOST_LEN);
+	if (fl->hosts[idx] == NULL)
+		err(1, "fleet");
+
+	munmap(ff->map, ff->len);
+	ff->map = NULL;
+}
+
+static int
+file_cmp(const void *a, const void *b)
+{
+
+	return strcmp(((const struct fleet_file *)a)->path,
+			((const struct fleet_file *)b)->path);
+}
+
+/**
+ * Load every snapshot in a directory
+ *
+ * Returns the number of snapshots loaded or -1 if the directory can't be read
+ */
+static int
+fleet_load(struct fleet *fl, const char *dir, uint32_t nthreads)
+{
+	struct fleet_file *ff;
+	struct dirent *de;
+	DIR *d;
+	uint32_t i, c, nvalid = 0;
+
+	d = opendir(dir);
+	if (d == NULL) {
+		xo_warn("%s", dir);
+		return -1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		ff = realloc(fl->files, (fl->nfiles + 1) * sizeof(*ff));
+		if (ff == NULL)
+			err(1, "fleet");
+		fl->files = ff;
+		ff = &fl->files[fl->nfiles++];
+		memset(ff, 0, sizeof(*ff));
+		snprintf(ff->path, sizeof(ff->path), "%s/%s", dir, de->d_name);
+	}
+
+	closedir(d);
+
+	/* Keep the output in a stable order */
+	qsort(fl->files, fl->nfiles, sizeof(*fl->files), file_cmp);
+
+	work_run(fl->nfiles, nthreads, fleet_map, fl->files);
+
+	for (i = 0; i < fl->nfiles; i++) {
+		fl->files[i].first = fl->nrows;
+		fl->nrows += fl->files[i].nrec;
+		if (fl->files[i].map != NULL)
+			nvalid++;
+		else
+			xo_warnx("%s: not a snapshot", fl->files[i].path);
+	}
+
+	fl->hosts = calloc(fl->nfiles + 1, sizeof(char *));
+	for (c = 0; c < COL_NCOLS; c++) {
+		fl->col[c] = malloc((fl->nrows + 1) * sizeof(uint32_t));
+		if (fl->col[c] == NULL)
+			err(1, "fleet");
+	}
+	if (fl->hosts == NULL)
+		err(1, "fleet");
+
+	work_run(fl->nfiles, nthreads, fleet_fill, fl);
+
+	return nvalid;
+}
+
+static void
+fleet_free(struct fleet *fl)
+{
+	uint32_t i;
+
+	for (i = 0; i < fl->nfiles; i++)
+		free(fl->hosts ? fl->hosts[i] : NULL);
+	for (i = 0; i < COL_NCOLS; i++)
+		free(fl->col[i]);
+	free(fl->hosts);
+	free(fl->files);
+}
+
+static int
+fleet_col(const char *name, size_t len)
+{
+	uint32_t c;
+
+	for (c = 0; c < COL_NCOLS; c++) {
+		if ((strlen(col_def[c].name) == len) &&
+				(strncmp(col_def[c].name, name, len) == 0))
+			return c;
+	}
+
+	return -1;
+}
+
+/**
+ * Parse a condition of the form <field><op><value>
+ *
+ * Class values of 2 or 4 hex digits match a class prefix. Speed and width
+ * values may be written as e.g. Gen4 and x8.
+ */
+static int
+fleet_parse_cond(char *s, struct fleet_cond *c)
+{
+	static const struct { const char *str; enum fleet_op op; } ops[] = {
+		{ "<=", OP_LE }, { ">=", OP_GE }, { "!=", OP_NE },
+		{ "<", OP_LT }, { ">", OP_GT }, { "=", OP_EQ },
+	};
+	size_t len = strcspn(s, "<>!=");
+	char *v, *end;
+	uint32_t i;
+	int col;
+
+	col = fleet_col(s, len);
+	if (col < 0) {
+		xo_warnx("Unknown field in '%s'", s);
+		return -1;
+	}
+	c->col = col;
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (strncmp(s + len, ops[i].str, strlen(ops[i].str)) == 0)
+			break;
+	}
+	if (i == sizeof(ops) / sizeof(ops[0])) {
+		xo_warnx("Missing operator in '%s'", s);
+		return -1;
+	}
+	c->op = ops[i].op;
+	v = s + len + strlen(ops[i].str);
+
+	c->mask = ~0U;
+	c->str = NULL;
+
+	if (col == COL_HOST) {
+		if ((c->op != OP_EQ) && (c->op != OP_NE)) {
+			xo_warnx("Hosts can only be compared with = or !=");
+			return -1;
+		}
+		c->str = v;
+		return 0;
+	}
+
+	if (col_def[col].base == 10) {
+		while ((*v != '\0') && ((*v < '0') || (*v > '9')))
+			v++;
+	}
+
+	c->value = strtoul(v, &end, col_def[col].base);
+	if ((end == v) || (*end != '\0')) {
+		xo_warnx("Bad value in '%s'", s);
+		return -1;
+	}
+
+	if ((col == COL_CLASS) && (end - v < 6)) {
+		uint32_t shift = (6 - (end - v)) * 4;
+
+		c->value <<= shift;
+		c->mask = 0xffffff & ~((1U << shift) - 1);
+	}
+
+	return 0;
+}
+
+static int
+fleet_cond_match(const struct fleet *fl, const struct fleet_cond *c, uint32_t row)
+{
+	uint32_t v = fl->col[c->col][row] & c->mask;
+
+	if (c->str != NULL) {
+		int eq = strcmp(fl->hosts[v], c->str) == 0;
+
+		return c->op == OP_EQ ? eq : !eq;
+	}
+
+	switch (c->op) {
+	case OP_EQ:
+		return v == c->value;
+	case OP_NE:
+		return v != c->value;
+	case OP_LT:
+		return v < c->value;
+	case OP_LE:
+		return v <= c->value;
+	case OP_GT:
+		return v > c->value;
+	case OP_GE:
+		return v >= c->value;
+	}
+
+	return 0;
+}
+
+static int
+fleet_match(const struct fleet *fl, const struct fleet_term *t, uint32_t nterms,
+		uint32_t row)
+{
+	uint32_t i, a;
+
+	for (i = 0; i < nterms; i++) {
+		for (a = 0; a < t[i].nalt; a++) {
+			if (fleet_cond_match(fl, &t[i].alt[a], row))
+				break;
+		}
+		if (a == t[i].nalt)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+fleet_emit_value(const struct fleet *fl, enum fleet_col c, uint32_t v)
+{
+	char fmt[64];
+
+	if (c == COL_HOST) {
+		xo_emit("{:host/%s}", fl->hosts[v]);
+	} else if (c == COL_BDF) {
+		xo_emit("{:bdf/%04x:%02x:%02x.%u}", v >> 16, (v >> 8) & 0xff,
+				(v >> 3) & 0x1f, v & 0x7);
+	} else if (col_def[c].base == 16) {
+		snprintf(fmt, sizeof(fmt), "{:%s/%%0%ux}", col_def[c].name,
+				col_def[c].digits);
+		xo_emit(fmt, v);
+	} else {
+		snprintf(fmt, sizeof(fmt), "{:%s/%%u}", col_def[c].name);
+		xo_emit(fmt, v);
+	}
+}
+
+/* Group by columns for the row comparison used by qsort */
+static const struct fleet *sort_fleet;
+static const enum fleet_col *sort_cols;
+static uint32_t sort_ncols;
+
+static int
+row_cmp(const void *a, const void *b)
+{
+	uint32_t ra = *(const uint32_t *)a, rb = *(const uint32_t *)b;
+	uint32_t i;
+
+	for (i = 0; i < sort_ncols; i++) {
+		uint32_t va = sort_fleet->col[sort_cols[i]][ra];
+		uint32_t vb = sort_fleet->col[sort_cols[i]][rb];
+		int rc;
+
+		if (sort_cols[i] == COL_HOST) {
+			rc = strcmp(sort_fleet->hosts[va], sort_fleet->hosts[vb]);
+			if (rc)
+				return rc;
+		} else if (va != vb) {
+			return va < vb ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+struct fleet_group {
+	uint32_t row;		/* first row of the group */
+	uint32_t count;
+};
+
+static int
+group_cmp(const void *a, const void *b)
+{
+	const struct fleet_group *ga = a, *gb = b;
+
+	if (ga->count != gb->count)
+		return ga->count > gb->count ? -1 : 1;
+
+	return row_cmp(&ga->row, &gb->row);
+}
+
+/**
+ * Count the matching rows by the values of the group by columns
+ */
+static void
+fleet_count(const struct fleet *fl, uint32_t *rows, uint32_t n,
+		const enum fleet_col *cols, uint32_t ncols)
+{
+	struct fleet_group *groups;
+	uint32_t i, c, ngroups = 0;
+
+	sort_fleet = fl;
+	sort_cols = cols;
+	sort_ncols = ncols;
+
+	qsort(rows, n, sizeof(uint32_t), row_cmp);
+
+	groups = malloc((n + 1) * sizeof(*groups));
+	if (groups == NULL)
+		err(1, "fleet");
+
+	for (i = 0; i < n; i++) {
+		if ((ngroups == 0) ||
+				row_cmp(&groups[ngroups - 1].row, &rows[i])) {
+			groups[ngroups].row = rows[i];
+			groups[ngroups].count = 0;
+			ngroups++;
+		}
+		groups[ngroups - 1].count++;
+	}
+
+	qsort(groups, ngroups, sizeof(*groups), group_cmp);
+
+	xo_open_list("group");
+
+	for (i = 0; i < ngroups; i++) {
+		xo_open_instance("group");
+		xo_emit("{:count/%8u} ", groups[i].count);
+		for (c = 0; c < ncols; c++) {
+			if (c)
+				xo_emit(" ");
+			fleet_emit_value(fl, cols[c], fl->col[cols[c]][groups[i].row]);
+		}
+		xo_emit("\n");
+		xo_close_instance("group");
+	}
+
+	xo_close_list("group");
+
+	free(groups);
+}
+
+static void
+fleet_list(const struct fleet *fl, const uint32_t *rows, uint32_t n)
+{
+	static const enum fleet_col cols[] = {
+		COL_HOST, COL_BDF, COL_VENDOR, COL_DEVICE, COL_CLASS,
+		COL_REVISION,
+	};
+	uint32_t i, c;
+
+	xo_open_list("device");
+
+	for (i = 0; i < n; i++) {
+		uint32_t r = rows[i];
+
+		xo_open_instance("device");
+		for (c = 0; c < sizeof(cols) / sizeof(cols[0]); c++) {
+			fleet_emit_value(fl, cols[c], fl->col[cols[c]][r]);
+			xo_emit(" ");
+		}
+		xo_emit("Gen{:speed/%u} x{:width/%u} (Gen{:maxspeed/%u} x{:maxwidth/%u})\n",
+				fl->col[COL_SPEED][r], fl->col[COL_WIDTH][r],
+				fl->col[COL_MAX_SPEED][r], fl->col[COL_MAX_WIDTH][r]);
+		xo_close_instance("device");
+	}
+
+	xo_close_list("device");
+}
+
+static void
+fleet_query(const char *dir, char **argv, int argc, char *count,
+		uint32_t nthreads)
+{
+	struct fleet fl;
+	struct fleet_term terms[FLEET_MAX_TERMS];
+	enum fleet_col group[FLEET_MAX_GROUP];
+	uint32_t nterms = 0, ngroup = 0, *rows, n = 0, r;
+	char *tok, *alt;
+	int i, col, nhosts;
+
+	if (argc > FLEET_MAX_TERMS) {
+		xo_warnx("At most %u terms are supported", FLEET_MAX_TERMS);
+		return;
+	}
+
+	for (i = 0; i < argc; i++, nterms++) {
+		struct fleet_term *t = &terms[nterms];
+
+		t->nalt = 0;
+		for (alt = strtok(argv[i], "|"); alt != NULL; alt = strtok(NULL, "|")) {
+			if (t->nalt == FLEET_MAX_ALTS) {
+				xo_warnx("At most %u alternatives are supported",
+						FLEET_MAX_ALTS);
+				return;
+			}
+			if (fleet_parse_cond(alt, &t->alt[t->nalt++]))
+				return;
+		}
+	}
+
+	if (count != NULL) {
+		for (tok = strtok(count, ","); tok != NULL; tok = strtok(NULL, ",")) {
+			col = fleet_col(tok, strlen(tok));
+			if (col < 0) {
+				xo_warnx("Unknown field '%s'", tok);
+				return;
+			}
+			if (ngroup == FLEET_MAX_GROUP) {
+				xo_warnx("At most %u count fields are supported",
+						FLEET_MAX_GROUP);
+				return;
+			}
+			group[ngroup++] = col;
+		}
+	}
+
+	memset(&fl, 0, sizeof(fl));
+
+	nhosts = fleet_load(&fl, dir, nthreads);
+	if (nhosts < 0) {
+		fleet_free(&fl);
+		return;
+	}
+
+	rows = malloc((fl.nrows + 1) * sizeof(uint32_t));
+	if (rows == NULL)
+		err(1, "fleet");
+
+	for (r = 0; r < fl.nrows; r++) {
+		if (fleet_match(&fl, terms, nterms, r))
+			rows[n++] = r;
+	}
+
+	xo_open_container("fleet");
+	xo_emit("{:matches/%u} {L:of} {:devices/%u} {L:devices on} {:hosts/%u} {L:hosts}\n",
+			n, fl.nrows, nhosts);
+
+	if (ngroup != 0)
+		fleet_count(&fl, rows, n, group, ngroup);
+	else
+		fleet_list(&fl, rows, n);
+
+	xo_close_container("fleet");
+
+	free(rows);
+	fleet_free(&fl);
+}
+
+/**
+ * Capture and query snapshots of devices across many hosts
+ */
+void
+fleet(int argc, char *argv[])
+{
+	char *count = NULL;
+	uint32_t nthreads = 0;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "c:j:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'c':
+			count = optarg;
+			break;
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) {
+		usage();
+		return;
+	}
+
+	if (nthreads == 0)
+		nthreads = work_default_threads();
+
+	if (strcmp(argv[0], "capture") == 0) {
+		fleet_capture(argv[1]);
+	} else if (strcmp(argv[0], "query") == 0) {
+		fleet_query(argv[1], argv + 2, argc - 2, count, nthreads);
+	} else {
+		usage();
+	}
+}
@@ -0,0 +1,99 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memoized device name lookups
+ *
+ * Hosts with many identical functions (e.g. SR-IOV virtual functions)
+ * would otherwise search the PCI ID database for the same vendor and
+ * device repeatedly.
+ */
+
+#include <stdlib.h>
+#include <pciaccess.h>
+
+#include "pci_stats.h"
+
+extern const char *pci_device_get_class_name( const struct pci_device * );
+
+#define NAME_CACHE_SIZE	1024	/* must be a power of 2 */
+
+struct name_entry {
+	uint32_t id;		/* vendor << 16 | device */
+	int valid;
+	const char *vname;
+	const char *dname;
+};
+
+static struct name_entry name_cache[NAME_CACHE_SIZE];
+
+/**
+ * Look up the class, vendor, and device names of a device
+ */
+void
+pci_device_get_names(const struct pci_device *pdev, const char **cname,
+		const char **vname, const char **dname)
+{
+	uint32_t id = (pdev->vendor_id << 16) | pdev->device_id;
+	uint32_t h = (id * 2654435761U) & (NAME_CACHE_SIZE - 1);
+	uint32_t n;
+
+	stats_begin(STATS_NAMES);
+	stats_count(STATS_NAME_LOOKUP, 1);
+
+	*cname = pci_device_get_class_name(pdev);
+
+	/* Open addressing with linear probing */
+	for (n = 0; n < NAME_CACHE_SIZE; n++) {
+		struct name_entry *e = &name_cache[(h + n) & (NAME_CACHE_SIZE - 1)];
+
+		if (e->valid && (e->id == id)) {
+			*vname = e->vname;
+			*dname = e->dname;
+			stats_count(STATS_NAME_HIT, 1);
+			stats_end(STATS_NAMES);
+			return;
+		}
+
+		if (!e->valid) {
+			e->id = id;
+			e->vname = pci_device_get_vendor_name(pdev);
+			e->dname = pci_device_get_device_name(pdev);
+			e->valid = 1;
+
+			*vname = e->vname;
+			*dname = e->dname;
+			stats_end(STATS_NAMES);
+			return;
+		}
+	}
+
+	/* The cache is full */
+	*vname = pci_device_get_vendor_name(pdev);
+	*dname = pci_device_get_device_name(pdev);
+
+	stats_end(STATS_NAMES);
+}
@@ -0,0 +1,421 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Peer-to-peer path analysis
+ *
+ * Traffic between two devices below the same switch is routed by the
+ * switch unless Access Control Services (ACS) on the downstream port
+ * redirects it upstream. Otherwise it crosses the root complex. This
+ * reports which route peer requests take, the slowest link on that
+ * route, and the IOMMU groups of the devices.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern void usage(void);
+extern struct pci_slot_match *parse_selector(const char *s);
+extern void tree_build(void);
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+extern void tree_free(void);
+
+#define SYSFS_PCI_DEVICES	"/sys/bus/pci/devices"
+#define SYSFS_IOMMU_GROUPS	"/sys/kernel/iommu_groups"
+
+/* Maximum number of bridges between a device and its root port */
+#define MAX_DEPTH		32
+
+struct path {
+	struct pci_device *dev[MAX_DEPTH];	/* device, then each bridge above it */
+	uint32_t n;
+};
+
+struct p2p_link {
+	struct pci_device *pdev;	/* upstream port of the link */
+	uint16_t speed;
+	uint16_t width;
+	uint32_t mbps;
+};
+
+static struct pci_device *
+find_device(const char *sel)
+{
+	struct pci_slot_match *pmatch;
+	struct pci_device_iterator *iter;
+	struct pci_device *pdev;
+
+	pmatch = parse_selector(sel);
+	if (pmatch == NULL) {
+		xo_warnx("Bad selector '%s'", sel);
+		return NULL;
+	}
+
+	iter = pci_slot_match_iterator_create(pmatch);
+	pdev = pci_device_next(iter);
+	pci_iterator_destroy(iter);
+	free(pmatch);
+
+	if (pdev == NULL)
+		xo_warnx("No device matches '%s'", sel);
+
+	return pdev;
+}
+
+static void
+path_build(struct pci_device *pdev, struct path *p)
+{
+
+	for (p->n = 0; (pdev != NULL) && (p->n < MAX_DEPTH); p->n++) {
+		p->dev[p->n] = pdev;
+		pdev = tree_parent(pdev);
+	}
+}
+
+/**
+ * Return the index of a device in the path or -1 if not present
+ */
+static int
+path_index(const struct path *p, const struct pci_device *pdev)
+{
+	uint32_t i;
+
+	for (i = 0; i < p->n; i++) {
+		if (p->dev[i] == pdev)
+			return i;
+	}
+
+	return -1;
+}
+
+static uint8_t
+port_type(struct pci_device *pdev, uint32_t *cap)
+{
+	uint16_t caps = 0;
+
+	*cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+	if (*cap != 0)
+		read_cfg(pdev, *cap + PCIE_CAPS, &caps, 2);
+
+	return PCIE_CAPS_TYPE(caps);
+}
+
+static const char *
+bdf_str(const struct pci_device *pdev, char *buf, size_t len)
+{
+
+	snprintf(buf, len, "%04x:%02x:%02x.%u",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+
+	return buf;
+}
+
+/**
+ * Does ACS on the port where peer requests enter the common switch send
+ * them upstream instead?
+ *
+ * Returns the ACS Control register or -1 if the port doesn't implement
+ * ACS (in which case requests are routed directly).
+ */
+static int32_t
+acs_ctl(struct pci_device *pdev)
+{
+	uint32_t cap;
+	uint16_t ctl = 0;
+
+	cap = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_ACS);
+	if ((cap == 0) || read_cfg(pdev, cap + ACS_CTL, &ctl, 2))
+		return -1;
+
+	return ctl;
+}
+
+/**
+ * Add the links a path traverses below the device at index 'top'
+ *
+ * Each physical link is described by the Link Status of its upstream
+ * port, i.e. any PCI Express function other than a root or downstream
+ * port which has a bridge above it. Functions of a multi-function device
+ * share a link, so it is only added once.
+ */
+static uint32_t
+path_links(const struct path *p, uint32_t top, struct p2p_link *l, uint32_t n)
+{
+	uint32_t i, j;
+
+	for (i = 0; (i < top) && (i < p->n); i++) {
+		struct pci_device *pdev = p->dev[i];
+		uint32_t cap;
+		uint16_t lnksta = 0;
+		uint8_t type;
+
+		if (tree_parent(pdev) == NULL)
+			continue;
+
+		type = port_type(pdev, &cap);
+		if ((cap == 0) || (type == PCIE_TYPE_ROOT_PORT) ||
+				(type == PCIE_TYPE_DOWNSTREAM))
+			continue;
+
+		for (j = 0; j < n; j++) {
+			if ((l[j].pdev->domain == pdev->domain) &&
+					(l[j].pdev->bus == pdev->bus) &&
+					(l[j].pdev->dev == pdev->dev))
+				break;
+		}
+		if (j < n)
+			continue;
+
+		read_cfg(pdev, cap + PCIE_LNKSTA, &lnksta, 2);
+
+		l[n].pdev = pdev;
+		l[n].speed = PCIE_LNKSTA_SPEED(lnksta);
+		l[n].width = PCIE_LNKSTA_WIDTH(lnksta);
+		l[n].mbps = l[n].width * (l[n].speed < PCIE_NUM_SPEEDS ?
+				pcie_lane_mbps[l[n].speed] : 0);
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Return the IOMMU group number of a device or -1 if it has none
+ */
+static int
+iommu_group(const struct pci_device *pdev)
+{
+	char path[128], link[128], *slash;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), SYSFS_PCI_DEVICES "/%04x:%02x:%02x.%u/iommu_group",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len <= 0)
+		return -1;
+
+	link[len] = '\0';
+	slash = strrchr(link, '/');
+
+	return atoi(slash ? slash + 1 : link);
+}
+
+static void
+emit_iommu_group(const struct pci_device *pdev)
+{
+	char path[128], bdf[16];
+	struct dirent *de;
+	DIR *d;
+	int group;
+
+	group = iommu_group(pdev);
+
+	xo_open_instance("iommu-group");
+
+	xo_emit("  IOMMU group {k:device/%s} ", bdf_str(pdev, bdf, sizeof(bdf)));
+	if (group < 0) {
+		xo_emit("{:group/none}\n");
+		xo_close_instance("iommu-group");
+		return;
+	}
+
+	xo_emit("{:group/%d}:", group);
+
+	snprintf(path, sizeof(path), SYSFS_IOMMU_GROUPS "/%d/devices", group);
+	d = opendir(path);
+	if (d != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			xo_emit(" {l:member}", de->d_name);
+		}
+		closedir(d);
+	}
+	xo_emit("\n");
+
+	xo_close_instance("iommu-group");
+}
+
+static void
+emit_links(const struct p2p_link *l, uint32_t n)
+{
+	const struct p2p_link *worst = NULL;
+	char bdf[16];
+	uint32_t i;
+
+	xo_open_list("link");
+
+	for (i = 0; i < n; i++) {
+		xo_open_instance("link");
+		xo_emit("    {k:bdf/%s} Gen{:speed/%u} x{:width/%u} {:bandwidth/%u} MB/s\n",
+				bdf_str(l[i].pdev, bdf, sizeof(bdf)),
+				l[i].speed, l[i].width, l[i].mbps);
+		xo_close_instance("link");
+
+		if ((worst == NULL) || (l[i].mbps < worst->mbps))
+			worst = &l[i];
+	}
+
+	xo_close_list("link");
+
+	if (worst != NULL) {
+		xo_emit("  Bottleneck {:bottleneck/%s} Gen{:bottleneck-speed/%u} x{:bottleneck-width/%u} {:bottleneck-bandwidth/%u} MB/s\n",
+				bdf_str(worst->pdev, bdf, sizeof(bdf)),
+				worst->speed, worst->width, worst->mbps);
+	}
+}
+
+/**
+ * Report the route peer-to-peer traffic between two devices takes
+ */
+void
+p2p(int argc, char *argv[])
+{
+	struct pci_device *a, *b, *common = NULL, *redirect = NULL;
+	struct p2p_link links[2 * MAX_DEPTH];
+	struct path pa, pb;
+	const char *reason;
+	char bdf[16];
+	uint32_t ia, ib, i, n;
+	int idx, group_a, group_b;
+
+	if (argc != 3) {
+		usage();
+		return;
+	}
+
+	a = find_device(argv[1]);
+	b = find_device(argv[2]);
+	if ((a == NULL) || (b == NULL))
+		return;
+
+	if (a == b) {
+		xo_warnx("Both selectors match %s", bdf_str(a, bdf, sizeof(bdf)));
+		return;
+	}
+
+	tree_build();
+
+	path_build(a, &pa);
+	path_build(b, &pb);
+
+	/* The lowest common bridge is the first of B's bridges on A's path */
+	ia = pa.n;
+	ib = pb.n;
+	for (i = 1; i < pb.n; i++) {
+		idx = path_index(&pa, pb.dev[i]);
+		if (idx > 0) {
+			common = pb.dev[i];
+			ia = idx;
+			ib = i;
+			break;
+		}
+	}
+
+	/*
+	 * Below a switch, requests are routed at the port where they enter
+	 * the common bridge: the downstream port on each path or, for
+	 * functions of one device, the function itself
+	 */
+	if (common == NULL) {
+		reason = "no common switch";
+	} else {
+		int32_t ctl_a = acs_ctl(pa.dev[ia - 1]);
+		int32_t ctl_b = acs_ctl(pb.dev[ib - 1]);
+
+		if ((ctl_a > 0) && (ctl_a & ACS_RR))
+			redirect = pa.dev[ia - 1];
+		else if ((ctl_b > 0) && (ctl_b & ACS_RR))
+			redirect = pb.dev[ib - 1];
+
+		if (redirect != NULL)
+			reason = "ACS P2P request redirect";
+		else if ((ctl_a < 0) || (ctl_b < 0))
+			reason = "no ACS";
+		else
+			reason = "ACS allows P2P";
+	}
+
+	xo_open_container("p2p");
+
+	xo_emit("{:device-a/%s} <-> ", bdf_str(a, bdf, sizeof(bdf)));
+	xo_emit("{:device-b/%s}\n", bdf_str(b, bdf, sizeof(bdf)));
+
+	if (common != NULL)
+		xo_emit("  Common bridge {:common-bridge/%s}\n",
+				bdf_str(common, bdf, sizeof(bdf)));
+	else
+		xo_emit("  Common bridge {:common-bridge/none}\n");
+
+	if ((common != NULL) && (redirect == NULL)) {
+		xo_emit("  Route {:route/direct} ({:reason/%s})\n", reason);
+
+		/* Only the links below the ingress ports are used */
+		ia--;
+		ib--;
+	} else {
+		xo_emit("  Route {:route/root-complex} ({:reason/%s}", reason);
+		if (redirect != NULL)
+			xo_emit(" on {:redirect-port/%s}",
+					bdf_str(redirect, bdf, sizeof(bdf)));
+		xo_emit(")\n");
+
+		/* Redirected traffic climbs to the root port on both sides */
+		ia = pa.n;
+		ib = pb.n;
+	}
+
+	n = path_links(&pa, ia, links, 0);
+	n = path_links(&pb, ib, links, n);
+
+	xo_emit("  Links\n");
+	emit_links(links, n);
+
+	group_a = iommu_group(a);
+	group_b = iommu_group(b);
+
+	xo_open_list("iommu-group");
+	emit_iommu_group(a);
+	emit_iommu_group(b);
+	xo_close_list("iommu-group");
+
+	if ((group_a >= 0) && (group_a == group_b))
+		xo_emit("  {:iommu-isolation/shared} IOMMU group, the devices cannot be assigned separately\n");
+	else if ((group_a >= 0) && (group_b >= 0))
+		xo_emit("  {:iommu-isolation/separate} IOMMU groups\n");
+
+	xo_close_container("p2p");
+
+	tree_free();
+}
@@ -0,0 +1,358 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Power management report
+ *
+ * Shows the D-state, PME support, and link power features of each device
+ * along with the kernel's runtime power management status. Optionally
+ * measures how long a device takes to return to D0 from D3hot.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+#include "pci_state.h"
+
+extern struct pci_slot_match *parse_selector(const char *s);
+
+#define SYSFS_PCI_DEVICES	"/sys/bus/pci/devices"
+
+/* D0 to D3hot and D3hot to D0 transitions take 10ms (PCI PM 5.9) */
+#define PM_D3HOT_DELAY_US	10000
+#define PM_READY_TIMEOUT_NS	(1000 * 1000000ULL)
+#define PM_POLL_US		10
+
+static struct option opts[] = {
+	{ "low-power", no_argument, NULL, 'l'},
+	{ "measure", no_argument, NULL, 'm'},
+	{ "selector", required_argument, NULL, 's'},
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *pm_state_name[] = { "D0", "D1", "D2", "D3hot" };
+static const char *pme_state_name[] = { "D0", "D1", "D2", "D3hot", "D3cold" };
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_ns(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+
+	while (nanosleep(&ts, &ts) && (errno == EINTR))
+		;
+}
+
+/**
+ * Read a sysfs attribute of a device, returning "-" if not present
+ */
+static const char *
+sysfs_attr(struct pci_device *pdev, const char *attr, char *buf, size_t len)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), SYSFS_PCI_DEVICES "/%04x:%02x:%02x.%u/%s",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func, attr);
+
+	f = fopen(path, "r");
+	if ((f == NULL) || (fgets(buf, len, f) == NULL)) {
+		snprintf(buf, len, "-");
+	} else {
+		buf[strcspn(buf, "\n")] = '\0';
+	}
+
+	if (f != NULL)
+		fclose(f);
+
+	return buf;
+}
+
+/**
+ * Time a round trip from D0 to D3hot and back
+ *
+ * The configuration state is saved beforehand and restored afterwards as
+ * devices without No Soft Reset are reset by the return to D0. The return
+ * to D0 is only timed for devices with Immediate Readiness; others may
+ * not be accessed until their recovery time has passed.
+ */
+static void
+pm_measure(struct pci_device *pdev, uint32_t cap, uint16_t pmcsr)
+{
+	struct pci_state st;
+	uint64_t start, d3_ns, ready_ns = 0, d0_ns, delay_ns;
+	const char *src;
+	int32_t rc;
+
+	xo_open_container("measurement");
+
+	if ((pmcsr & PM_CTRL_STATE) != PM_CTRL_D0) {
+		xo_emit("    D3hot->D0 {:status/skipped} (not in D0)\n");
+		goto out;
+	}
+
+	if (pci_device_get_bridge_info(pdev) != NULL) {
+		xo_emit("    D3hot->D0 {:status/skipped} (bridge)\n");
+		goto out;
+	}
+
+	if (pci_driver_bound(pdev)) {
+		xo_emit("    D3hot->D0 {:status/skipped} (driver bound)\n");
+		goto out;
+	}
+
+	rc = pci_state_save(pdev, &st);
+	if (rc) {
+		xo_emit("    D3hot->D0 {:status/failed} ({:error/%s})\n", strerror(rc));
+		goto out;
+	}
+
+	start = now_ns();
+	rc = pci_set_power_state(pdev, cap, PM_CTRL_D3HOT);
+	d3_ns = now_ns() - start;
+	if (rc) {
+		xo_emit("    D3hot->D0 {:status/failed} ({:error/%s})\n", strerror(rc));
+		goto out;
+	}
+
+	usleep(PM_D3HOT_DELAY_US);
+
+	pmcsr = 0;
+	read_cfg(pdev, cap + PM_CTRL, &pmcsr, 2);
+	if ((pmcsr & PM_CTRL_STATE) != PM_CTRL_D3HOT) {
+		xo_emit("    D3hot->D0 {:status/failed} (entered {:state/%s})\n",
+				pm_state_name[pmcsr & PM_CTRL_STATE]);
+		pci_set_power_state(pdev, cap, PM_CTRL_D0);
+		usleep(PM_D3HOT_DELAY_US);
+		pci_state_restore(pdev, &st);
+		goto out;
+	}
+
+	/*
+	 * The function may not be accessed during its recovery time. Only a
+	 * function with Immediate Readiness can be timed by polling; for the
+	 * others the required recovery time is reported.
+	 */
+	delay_ns = pci_d0_delay(pdev, cap, &src);
+
+	start = now_ns();
+	rc = pci_set_power_state(pdev, cap, PM_CTRL_D0);
+	if ((rc == 0) && (delay_ns != 0))
+		sleep_ns(delay_ns);
+	if (rc == 0)
+		rc = pci_wait_ready(pdev, PM_READY_TIMEOUT_NS, &ready_ns);
+	while (rc == 0) {
+		pmcsr = 0;
+		read_cfg(pdev, cap + PM_CTRL, &pmcsr, 2);
+		if ((pmcsr & PM_CTRL_STATE) == PM_CTRL_D0)
+			break;
+		if (now_ns() - start > PM_READY_TIMEOUT_NS)
+			rc = ETIMEDOUT;
+		else
+			usleep(PM_POLL_US);
+	}
+	d0_ns = now_ns() - start;
+
+	pci_state_restore(pdev, &st);
+
+	if (rc) {
+		xo_emit("    D3hot->D0 {:status/failed} ({:error/%s})\n", strerror(rc));
+		goto out;
+	}
+
+	xo_emit("    D0->D3hot write {:d3-write-time/%ju}{U:us} ",
+			(uintmax_t)(d3_ns / 1000));
+	if (delay_ns == 0)
+		xo_emit("D3hot->D0 ready {:d0-latency/%ju}{U:us} ",
+				(uintmax_t)(d0_ns / 1000));
+	else
+		xo_emit("D3hot->D0 recovery {:d0-delay/%ju}{U:us} ",
+				(uintmax_t)(delay_ns / 1000));
+	xo_emit("({:recovery/%s}, {:reset/%s})\n",
+			delay_ns == 0 ? "immediate readiness" :
+				strcmp(src, "rtr") == 0 ? "readiness time reported" :
+				"PCI PM recovery time",
+			pmcsr & PM_CTRL_NSR ? "no soft reset" : "state restored");
+
+out:
+	xo_close_container("measurement");
+}
+
+static void
+pm_device(struct pci_device *pdev, int low_power, int measure)
+{
+	char runtime[32], control[32];
+	uint32_t cap, exp;
+	uint16_t pmc = 0, pmcsr = 0, devctl = 0, lnkctl = 0, devctl2 = 0;
+	uint32_t lnkcap = 0;
+	uint32_t i;
+	int low;
+
+	cap = pci_find_cap(pdev, PCI_CAP_ID_PM);
+	if (cap != 0) {
+		read_cfg(pdev, cap + PM_PMC, &pmc, 2);
+		read_cfg(pdev, cap + PM_CTRL, &pmcsr, 2);
+	}
+
+	sysfs_attr(pdev, "power/runtime_status", runtime, sizeof(runtime));
+	sysfs_attr(pdev, "power/control", control, sizeof(control));
+
+	low = ((pmcsr & PM_CTRL_STATE) != PM_CTRL_D0) ||
+		(strcmp(runtime, "suspended") == 0);
+	if (low_power && !low)
+		return;
+
+	xo_open_instance("device");
+
+	xo_emit("{k:bdf/%04x:%02x:%02x.%u} ",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+
+	if (cap != 0)
+		xo_emit("{:state/%s}", pm_state_name[pmcsr & PM_CTRL_STATE]);
+	else
+		xo_emit("{:state/-}");
+
+	xo_emit(" runtime {:runtime-status/%s} ({:runtime-control/%s})\n",
+			runtime, control);
+
+	if (cap != 0) {
+		xo_emit("    PM v{:pm-version/%u}", PM_PMC_VERSION(pmc));
+		if (pmc & PM_PMC_D1)
+			xo_emit(" {l:supported/D1}");
+		if (pmc & PM_PMC_D2)
+			xo_emit(" {l:supported/D2}");
+		if (pmcsr & PM_CTRL_NSR)
+			xo_emit(" {:no-soft-reset/NoSoftReset}");
+		xo_emit(" PME");
+		for (i = 0; i < 5; i++) {
+			if (PM_PMC_PME(pmc) & (1 << i))
+				xo_emit(" {l:pme-from/%s}", pme_state_name[i]);
+		}
+		xo_emit(" {:pme-enabled/%s}", pmcsr & PM_CTRL_PME_EN ? "enabled" : "disabled");
+		if (pmcsr & PM_CTRL_PME_STATUS)
+			xo_emit(" {:pme-status/asserted}");
+		xo_emit("\n");
+	}
+
+	exp = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+	if (exp != 0) {
+		read_cfg(pdev, exp + PCIE_DEVCTL, &devctl, 2);
+		read_cfg(pdev, exp + PCIE_LNKCAP, &lnkcap, 4);
+		read_cfg(pdev, exp + PCIE_LNKCTL, &lnkctl, 2);
+		read_cfg(pdev, exp + PCIE_DEVCTL2, &devctl2, 2);
+
+		xo_emit("    ASPM {:aspm/%s}",
+				(lnkctl & (PCIE_LNKCTL_ASPM_L0S | PCIE_LNKCTL_ASPM_L1)) ==
+				(PCIE_LNKCTL_ASPM_L0S | PCIE_LNKCTL_ASPM_L1) ? "L0s L1" :
+				lnkctl & PCIE_LNKCTL_ASPM_L0S ? "L0s" :
+				lnkctl & PCIE_LNKCTL_ASPM_L1 ? "L1" : "disabled");
+		xo_emit(" ClockPM {:clock-pm/%s}",
+				!(lnkcap & PCIE_LNKCAP_CLKPM) ? "unsupported" :
+				lnkctl & PCIE_LNKCTL_CLKREQ_EN ? "enabled" : "disabled");
+		xo_emit(" AuxPower {:aux-power/%s}",
+				devctl & PCIE_DEVCTL_AUX_PM ? "enabled" : "disabled");
+		xo_emit(" LTR {:ltr/%s}\n",
+				devctl2 & PCIE_DEVCTL2_LTR ? "enabled" : "disabled");
+	}
+
+	if (measure && (cap != 0))
+		pm_measure(pdev, cap, pmcsr);
+
+	xo_close_instance("device");
+}
+
+/**
+ * Report the power management state of each device
+ */
+void
+pm(int argc, char *argv[])
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct pci_slot_match *pmatch = NULL;
+	const char *sel_str = NULL;
+	int ch, low_power = 0, measure = 0;
+
+	while ((ch = getopt_long(argc, argv, "lms:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'l':
+			low_power = 1;
+			break;
+		case 'm':
+			measure = 1;
+			break;
+		case 's':
+			sel_str = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	/* Changing power states is only done to explicitly selected devices */
+	if (measure && (sel_str == NULL)) {
+		xo_warnx("--measure requires a selector");
+		return;
+	}
+
+	if (sel_str != NULL) {
+		pmatch = parse_selector(sel_str);
+		if (pmatch == NULL)
+			return;
+	}
+
+	iter = pci_slot_match_iterator_create(pmatch);
+
+	xo_open_list("device");
+
+	while ((pdev = pci_device_next(iter)) != NULL)
+		pm_device(pdev, low_power, measure);
+
+	xo_close_list("device");
+
+	pci_iterator_destroy(iter);
+	free(pmatch);
+}
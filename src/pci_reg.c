@@ -25,6 +25,7 @@
  */
 
 #include <ctype.h>
+#include <stdio.h>
 #include <string.h>
 #include <err.h>
 #include <getopt.h>
@@ -32,12 +33,24 @@
 #include <pciaccess.h>
 
 #include "pci_reg_name.h"
+#include "pci_cap.h"
+#include "pci_stats.h"
 
 #define MAX_STACK	4
 
 extern void usage(void);
 
+extern int ecam_mapped(const struct pci_device *pdev);
+extern int32_t ecam_read(struct pci_device *pdev, uint32_t off, void *v, uint32_t width);
+extern int32_t ecam_write(struct pci_device *pdev, uint32_t off, void *v, uint32_t width);
+extern uint64_t trace_start(void);
+extern void trace_access(struct pci_device *pdev, int write, uint32_t off,
+		uint32_t width, const void *v, int32_t rc, uint64_t start);
+
+extern int32_t ecam_read_range(struct pci_device *pdev, uint32_t off, void *buf, uint32_t len, uint32_t *nread);
+
 static struct option opts[] = {
+	{ "raw", no_argument, NULL, 'r'},
 	{ "selector", required_argument, NULL, 's'},
 	{ NULL, 0, NULL, 0 }
 };
@@ -163,18 +176,76 @@ parse_offset(const char *o, uint32_t *offset, uint32_t *width)
 }
 
 /**
- * Write a configuration register offset
+ * Parse a range of offsets
  *
- * Writes value pointed to by v to offset off
+ * Allowable range formats:
+ *   start-end    (inclusive, e.g. 0x100-0x1ff)
+ *   start+length (e.g. 0x40+64)
+ *   all          (the entire configuration space)
+ *
+ * Returns 0 if the string is a range, ENOENT if it is not a range or
+ * EINVAL if it is a malformed range
  */
 static int32_t
-write_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
+parse_range(const char *o, uint32_t *offset, uint32_t *len)
 {
+	char *o_end = NULL, *e_end = NULL;
+	uint32_t start, end;
 
-	if (v == NULL) {
+	if ((o == NULL) || (offset == NULL) || (len == NULL)) {
+		return EINVAL;
+	}
+
+	if (strcmp(o, "all") == 0) {
+		*offset = 0;
+		*len = PCI_CFG_SIZE_EXT;
+		return 0;
+	}
+
+	start = strtoul(o, &o_end, 0);
+	if (o_end == o) {
+		return ENOENT;
+	}
+
+	switch (*o_end) {
+	case '-':
+		end = strtoul(o_end + 1, &e_end, 0);
+		if ((e_end == o_end + 1) || (*e_end != '\0') || (end < start)) {
+			return EINVAL;
+		}
+		*len = end - start + 1;
+		break;
+	case '+':
+		*len = strtoul(o_end + 1, &e_end, 0);
+		if ((e_end == o_end + 1) || (*e_end != '\0')) {
+			return EINVAL;
+		}
+		break;
+	default:
+		return ENOENT;
+	}
+
+	if ((*len == 0) || (start >= PCI_CFG_SIZE_EXT)) {
 		return EINVAL;
 	}
 
+	/* start + *len may wrap */
+	if (*len > PCI_CFG_SIZE_EXT - start)
+		*len = PCI_CFG_SIZE_EXT - start;
+
+	*offset = start;
+
+	return 0;
+}
+
+static int32_t
+write_cfg_backend(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
+{
+
+	if (ecam_mapped(pdev)) {
+		return ecam_write(pdev, off, v, width);
+	}
+
 	switch (width) {
 	case 1:
 		return pci_device_cfg_write_u8(pdev, *((uint8_t *)v), off); 
@@ -187,15 +258,14 @@ write_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
 	}
 }
 
-/**
- * Read a configuration register offset
- *
- * Reads value at offset off into v
- */
 static int32_t
-read_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
+read_cfg_backend(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
 {
 
+	if (ecam_mapped(pdev)) {
+		return ecam_read(pdev, off, v, width);
+	}
+
 	switch (width) {
 	case 1:
 		return pci_device_cfg_read_u8(pdev, v, off);
@@ -208,17 +278,146 @@ read_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
 	}
 }
 
+/**
+ * Write a configuration register offset
+ *
+ * Writes value pointed to by v to offset off
+ */
+int32_t
+write_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
+{
+	uint64_t start;
+	int32_t rc;
+
+	if (v == NULL) {
+		return EINVAL;
+	}
+
+	stats_count_cfg(1, width);
+
+	start = trace_start();
+	rc = write_cfg_backend(pdev, off, v, width);
+	trace_access(pdev, 1, off, width, v, rc, start);
+
+	return rc;
+}
+
+/**
+ * Read a configuration register offset
+ *
+ * Reads value at offset off into v
+ */
+int32_t
+read_cfg(struct pci_device *pdev, uint32_t off, void *v, uint32_t width)
+{
+	uint64_t start;
+	int32_t rc;
+
+	stats_count_cfg(0, width);
+
+	start = trace_start();
+	rc = read_cfg_backend(pdev, off, v, width);
+	trace_access(pdev, 0, off, width, v, rc, start);
+
+	return rc;
+}
+
+/**
+ * Read a range of configuration space
+ *
+ * Reads up to len bytes starting at offset off into buf using a single
+ * bulk access. The number of bytes actually read is returned in nread as
+ * devices (or the OS) may limit the accessible configuration space.
+ */
+static int32_t
+read_cfg_range(struct pci_device *pdev, uint32_t off, void *buf, uint32_t len,
+		uint32_t *nread)
+{
+	pciaddr_t bytes = 0;
+	uint64_t start;
+	int32_t rc;
+
+	stats_count(STATS_READ_RANGE, 1);
+
+	start = trace_start();
+
+	if (ecam_mapped(pdev)) {
+		rc = ecam_read_range(pdev, off, buf, len, nread);
+	} else {
+		rc = pci_device_cfg_read(pdev, buf, off, len, &bytes);
+		*nread = bytes;
+	}
+
+	/* Range reads are recorded with a width of 0 and their length */
+	trace_access(pdev, 0, off, 0, nread, rc, start);
+
+	return rc;
+}
+
+/**
+ * Display a range of configuration space for each matching device
+ */
+static void
+get_range(struct pci_slot_match *pmatch, uint32_t off, uint32_t len, int raw)
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	uint8_t buf[PCI_CFG_SIZE_EXT];
+	uint32_t nread, i;
+	int text = xo_get_style(NULL) == XO_STYLE_TEXT;
+
+	iter = pci_slot_match_iterator_create(pmatch);
+
+	if (!raw && !text)
+		xo_open_list("device");
+
+	while (NULL != (pdev = pci_device_next(iter))) {
+		if (read_cfg_range(pdev, off, buf, len, &nread))
+			err(1, "get");
+
+		if (raw) {
+			fwrite(buf, 1, nread, stdout);
+		} else if (text) {
+			printf("get %04x:%02x:%02x.%u %x-%x\n",
+					pdev->domain, pdev->bus, pdev->dev, pdev->func,
+					off, off + nread - 1);
+			for (i = 0; i < nread; i++) {
+				if ((i % 16) == 0)
+					printf("%s%04x:", i ? "\n" : "", off + i);
+				printf(" %02x", buf[i]);
+			}
+			printf("\n");
+		} else {
+			xo_open_instance("device");
+			xo_emit("{k:bdf/%04x:%02x:%02x.%u}{:offset/%u}{:length/%u}",
+					pdev->domain, pdev->bus, pdev->dev, pdev->func,
+					off, nread);
+			for (i = 0; i < nread; i++)
+				xo_emit("{l:data/%u}", buf[i]);
+			xo_close_instance("device");
+		}
+	}
+
+	if (!raw && !text)
+		xo_close_list("device");
+
+	pci_iterator_destroy(iter);
+}
+
 /**
  * Get or set a PCI configuration register
  */
 void
 get_set(int argc, char *argv[])
 {
-	int ch;
+	int ch, raw = 0;
 	const char *sel_str = NULL;
 
-	while ((ch = getopt_long(argc, argv, "s:", opts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "rs:", opts, NULL)) != -1) {
 		switch (ch) {
+		case 'r':
+			raw = 1;
+			break;
 		case 's':
 			sel_str = optarg;
 			break;
@@ -234,8 +433,10 @@ get_set(int argc, char *argv[])
 		struct pci_slot_match *pmatch = NULL;
 		uint32_t off = UINT32_MAX;
 		uint32_t width = UINT32_MAX;
+		uint32_t len = 0;
 		uint32_t val = 0;
 		char *val_end = NULL;
+		int32_t rc;
 		int32_t (*op)(struct pci_device *, uint32_t, void *, uint32_t) = read_cfg;
 
 		if (argc < 1) {
@@ -244,6 +445,31 @@ get_set(int argc, char *argv[])
 			return;
 		}
 
+		rc = parse_range(argv[0], &off, &len);
+		if (rc == EINVAL) {
+			printf("Bad range '%s'\n", argv[0]);
+			usage();
+			return;
+		}
+
+		if (rc == 0) {
+			if (argc > 1) {
+				printf("Ranges can only be read\n");
+				usage();
+				return;
+			}
+
+			pmatch = parse_selector(sel_str);
+			if (pmatch) {
+				get_range(pmatch, off, len, raw);
+				free(pmatch);
+			} else {
+				printf("Bad selector format\n");
+				usage();
+			}
+			return;
+		}
+
 		parse_offset(argv[0], &off, &width);
 
 		if (argc > 1) {
@@ -0,0 +1,588 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Function and bus resets
+ *
+ * Each reset saves the configuration state, performs the reset, waits
+ * the time the device needs before it may be accessed, polls until it
+ * responds, and restores the state. Every phase is timed. Resets of
+ * different functions (or, for secondary bus resets, bridges) are done
+ * concurrently.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+#include "pci_state.h"
+
+extern struct pci_slot_match *parse_selector(const char *s);
+extern void tree_build(void);
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+extern void tree_free(void);
+extern uint32_t work_default_threads(void);
+extern void work_run(uint32_t n, uint32_t nthreads,
+		void (*fn)(void *arg, uint32_t idx), void *arg);
+
+/* Delays before a device may be accessed when it doesn't report its own */
+#define RESET_FLR_DELAY_NS	(100 * 1000000ULL)	/* PCIe 6.6.2 */
+#define RESET_SBR_DELAY_NS	(100 * 1000000ULL)	/* PCIe 6.6.1 */
+#define RESET_PM_DELAY_NS	(10 * 1000000ULL)	/* PCI PM 5.9 */
+
+/* Secondary Bus Reset must be held for at least 1ms */
+#define RESET_SBR_HOLD_US	1000
+#define RESET_PENDING_TIMEOUT_NS (100 * 1000000ULL)
+#define RESET_READY_TIMEOUT_NS	(1000 * 1000000ULL)
+
+enum reset_method {
+	RESET_FLR,
+	RESET_SBR,
+	RESET_PM,
+};
+
+static const char *method_name[] = { "flr", "sbr", "pm" };
+
+enum reset_phase {
+	PHASE_SAVE,
+	PHASE_RESET,
+	PHASE_WAIT,
+	PHASE_READY,
+	PHASE_RESTORE,
+	PHASE_NPHASES
+};
+
+static const char *phase_name[PHASE_NPHASES] = {
+	"save", "reset", "wait", "ready", "restore"
+};
+
+static struct option opts[] = {
+	{ "force", no_argument, NULL, 'f'},
+	{ "method", required_argument, NULL, 'm'},
+	{ "parallel", required_argument, NULL, 'j'},
+	{ "selector", required_argument, NULL, 's'},
+	{ NULL, 0, NULL, 0 }
+};
+
+/*
+ * A reset of one function (FLR, PM) or of every function below a bridge
+ * (SBR)
+ */
+struct reset_job {
+	enum reset_method method;
+	struct pci_device *pdev;	/* function or bridge to reset */
+	struct pci_device **devs;	/* functions whose state is restored */
+	struct pci_state *state;
+	uint32_t ndevs;
+	const char *skip;		/* reason the reset wasn't done */
+	int32_t rc;
+	uint64_t delay_ns;		/* required wait after the reset */
+	const char *delay_src;
+	uint64_t phase_ns[PHASE_NPHASES];
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_ns(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+
+	while (nanosleep(&ts, &ts) && (errno == EINTR))
+		;
+}
+
+/**
+ * Determine how long to wait after a reset before accessing a function
+ *
+ * Functions with Immediate Readiness may be accessed right away, and
+ * Readiness Time Reporting gives the time a function actually needs.
+ * Otherwise the delay the specification requires is used.
+ */
+static void
+reset_delay(struct pci_device *pdev, enum reset_method method, uint32_t pmcap,
+		uint64_t *delay_ns, const char **src)
+{
+	uint32_t rtr, r1 = 0, r2 = 0;
+	uint16_t status = 0;
+	const char *s = "spec";
+	uint64_t ns;
+
+	if (method == RESET_PM) {
+		ns = pci_d0_delay(pdev, pmcap, &s);
+		goto out;
+	}
+
+	ns = method == RESET_FLR ? RESET_FLR_DELAY_NS : RESET_SBR_DELAY_NS;
+
+	read_cfg(pdev, PCI_STATUS, &status, 2);
+
+	rtr = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_RTR);
+	if (rtr != 0) {
+		read_cfg(pdev, rtr + RTR_1, &r1, 4);
+		read_cfg(pdev, rtr + RTR_2, &r2, 4);
+	}
+
+	if (status & PCI_STATUS_IMM_READY) {
+		ns = 0;
+		s = "immediate";
+	} else if (r1 & RTR_VALID) {
+		ns = method == RESET_FLR ? RTR_NS(RTR_FLR_TIME(r2)) :
+			RTR_NS(RTR_RESET_TIME(r1));
+		s = "rtr";
+	}
+
+out:
+	/* Functions reset together wait for the slowest of them */
+	if ((*src == NULL) || (ns > *delay_ns)) {
+		*delay_ns = ns;
+		*src = s;
+	}
+}
+
+/**
+ * Wait for outstanding requests to complete and initiate an FLR
+ */
+static int32_t
+reset_flr(struct reset_job *job)
+{
+	struct pci_device *pdev = job->pdev;
+	uint64_t start = now_ns();
+	uint32_t cap;
+	uint16_t devsta, devctl = 0;
+	int32_t rc;
+
+	cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+
+	do {
+		devsta = 0;
+		read_cfg(pdev, cap + PCIE_DEVSTA, &devsta, 2);
+		if (!(devsta & PCIE_DEVSTA_TRPND))
+			break;
+		usleep(1000);
+	} while (now_ns() - start < RESET_PENDING_TIMEOUT_NS);
+
+	rc = read_cfg(pdev, cap + PCIE_DEVCTL, &devctl, 2);
+	if (rc)
+		return rc;
+
+	devctl |= PCIE_DEVCTL_FLR;
+
+	return write_cfg(pdev, cap + PCIE_DEVCTL, &devctl, 2);
+}
+
+/**
+ * Pulse Secondary Bus Reset in the bridge's Bridge Control register
+ */
+static int32_t
+reset_sbr(struct reset_job *job)
+{
+	uint16_t ctl = 0;
+	int32_t rc;
+
+	rc = read_cfg(job->pdev, PCI_BRIDGE_CTL, &ctl, 2);
+	if (rc)
+		return rc;
+
+	ctl |= PCI_BRIDGE_CTL_SBR;
+	rc = write_cfg(job->pdev, PCI_BRIDGE_CTL, &ctl, 2);
+	if (rc)
+		return rc;
+
+	usleep(RESET_SBR_HOLD_US);
+
+	ctl &= ~PCI_BRIDGE_CTL_SBR;
+
+	return write_cfg(job->pdev, PCI_BRIDGE_CTL, &ctl, 2);
+}
+
+/**
+ * Reset a function by cycling it through D3hot
+ */
+static int32_t
+reset_pm(struct reset_job *job)
+{
+	uint32_t cap = pci_find_cap(job->pdev, PCI_CAP_ID_PM);
+	int32_t rc;
+
+	rc = pci_set_power_state(job->pdev, cap, PM_CTRL_D3HOT);
+	if (rc)
+		return rc;
+
+	sleep_ns(RESET_PM_DELAY_NS);
+
+	return pci_set_power_state(job->pdev, cap, PM_CTRL_D0);
+}
+
+/**
+ * Check that the method can be used on the job's function(s)
+ */
+static const char *
+reset_check(struct reset_job *job, int force)
+{
+	struct pci_device *pdev = job->pdev;
+	uint32_t cap, devcap = 0, i;
+	uint16_t pmc = 0, pmcsr = 0;
+
+	for (i = 0; i < job->ndevs; i++) {
+		if (!force && pci_driver_bound(job->devs[i]))
+			return "driver bound";
+		if ((job->method == RESET_SBR) &&
+				(pci_device_get_bridge_info(job->devs[i]) != NULL))
+			return "bridge below";
+	}
+
+	/* Resetting a bridge resets everything below it too */
+	if ((job->method != RESET_SBR) &&
+			(pci_device_get_bridge_info(pdev) != NULL))
+		return "bridge";
+
+	switch (job->method) {
+	case RESET_FLR:
+		cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+		if (cap != 0)
+			read_cfg(pdev, cap + PCIE_DEVCAP, &devcap, 4);
+		if (!(devcap & PCIE_DEVCAP_FLR))
+			return "FLR not supported";
+		break;
+	case RESET_SBR:
+		if (job->ndevs == 0)
+			return "no devices below";
+		break;
+	case RESET_PM:
+		cap = pci_find_cap(pdev, PCI_CAP_ID_PM);
+		if (cap == 0)
+			return "no PM capability";
+		read_cfg(pdev, cap + PM_PMC, &pmc, 2);
+		read_cfg(pdev, cap + PM_CTRL, &pmcsr, 2);
+		if (pmcsr & PM_CTRL_NSR)
+			return "No Soft Reset set";
+		if ((pmcsr & PM_CTRL_STATE) != PM_CTRL_D0)
+			return "not in D0";
+		break;
+	}
+
+	return NULL;
+}
+
+static void
+reset_run(void *arg, uint32_t idx)
+{
+	struct reset_job *job = &((struct reset_job *)arg)[idx];
+	uint64_t t, ready_ns, max_ready = 0;
+	uint32_t i, pmcap = 0;
+	int32_t rc;
+
+	if (job->skip != NULL)
+		return;
+
+	t = now_ns();
+	for (i = 0; i < job->ndevs; i++) {
+		if (job->method == RESET_PM)
+			pmcap = pci_find_cap(job->devs[i], PCI_CAP_ID_PM);
+
+		job->rc = pci_state_save(job->devs[i], &job->state[i]);
+		if (job->rc)
+			return;
+
+		reset_delay(job->devs[i], job->method, pmcap, &job->delay_ns,
+				&job->delay_src);
+	}
+	job->phase_ns[PHASE_SAVE] = now_ns() - t;
+
+	t = now_ns();
+	switch (job->method) {
+	case RESET_FLR:
+		rc = reset_flr(job);
+		break;
+	case RESET_SBR:
+		rc = reset_sbr(job);
+		break;
+	default:
+		rc = reset_pm(job);
+		break;
+	}
+	job->phase_ns[PHASE_RESET] = now_ns() - t;
+	if (rc) {
+		job->rc = rc;
+		return;
+	}
+
+	t = now_ns();
+	sleep_ns(job->delay_ns);
+	job->phase_ns[PHASE_WAIT] = now_ns() - t;
+
+	/* Devices may still answer with Configuration RRS */
+	t = now_ns();
+	for (i = 0; i < job->ndevs; i++) {
+		rc = pci_wait_ready(job->devs[i], RESET_READY_TIMEOUT_NS, &ready_ns);
+		if (rc && (job->rc == 0))
+			job->rc = rc;
+		if (ready_ns > max_ready)
+			max_ready = ready_ns;
+	}
+	job->phase_ns[PHASE_READY] = now_ns() - t;
+
+	t = now_ns();
+	for (i = 0; i < job->ndevs; i++) {
+		rc = pci_state_restore(job->devs[i], &job->state[i]);
+		if (rc && (job->rc == 0))
+			job->rc = rc;
+	}
+	job->phase_ns[PHASE_RESTORE] = now_ns() - t;
+}
+
+static struct reset_job *
+job_add(struct reset_job **jobs, uint32_t *njobs, enum reset_method method,
+		struct pci_device *pdev)
+{
+	struct reset_job *job;
+
+	job = realloc(*jobs, (*njobs + 1) * sizeof(struct reset_job));
+	if (job == NULL)
+		err(1, "reset");
+	*jobs = job;
+	job = &job[(*njobs)++];
+
+	memset(job, 0, sizeof(*job));
+	job->method = method;
+	job->pdev = pdev;
+
+	return job;
+}
+
+static void
+job_add_dev(struct reset_job *job, struct pci_device *pdev)
+{
+	struct pci_device **d;
+	struct pci_state *st;
+
+	d = realloc(job->devs, (job->ndevs + 1) * sizeof(*d));
+	st = realloc(job->state, (job->ndevs + 1) * sizeof(*st));
+	if ((d == NULL) || (st == NULL))
+		err(1, "reset");
+
+	job->devs = d;
+	job->state = st;
+	job->devs[job->ndevs++] = pdev;
+}
+
+static void
+reset_emit(const struct reset_job *job)
+{
+	char fmt[64];
+	uint64_t total = 0;
+	uint32_t i;
+
+	xo_open_instance("reset");
+
+	xo_emit("{k:bdf/%04x:%02x:%02x.%u} {:method/%s} ",
+			job->pdev->domain, job->pdev->bus, job->pdev->dev,
+			job->pdev->func, method_name[job->method]);
+
+	if (job->skip != NULL) {
+		xo_emit("{:status/skipped} ({:reason/%s})\n", job->skip);
+		xo_close_instance("reset");
+		return;
+	}
+
+	for (i = 0; i < PHASE_NPHASES; i++) {
+		snprintf(fmt, sizeof(fmt), "%s {:%s-time/%%ju}{U:us} ",
+				phase_name[i], phase_name[i]);
+		xo_emit(fmt, (uintmax_t)(job->phase_ns[i] / 1000));
+		total += job->phase_ns[i];
+	}
+
+	xo_emit("total {:total-time/%ju}{U:us} ({:wait-source/%s}) ",
+			(uintmax_t)(total / 1000), job->delay_src);
+
+	if (job->rc)
+		xo_emit("{:status/failed} ({:error/%s})\n", strerror(job->rc));
+	else
+		xo_emit("{:status/ok}\n");
+
+	if (job->method == RESET_SBR) {
+		for (i = 0; i < job->ndevs; i++) {
+			xo_emit("    {l:restored/%04x:%02x:%02x.%u}\n",
+					job->devs[i]->domain, job->devs[i]->bus,
+					job->devs[i]->dev, job->devs[i]->func);
+		}
+	}
+
+	xo_close_instance("reset");
+}
+
+/**
+ * Reset the selected functions
+ */
+void
+reset(int argc, char *argv[])
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct pci_slot_match *pmatch = NULL;
+	struct reset_job *jobs = NULL, *job;
+	enum reset_method method = RESET_FLR;
+	const char *sel_str = NULL;
+	uint32_t njobs = 0, nthreads = 0, i, nreset = 0;
+	uint64_t start;
+	int ch, force = 0;
+
+	while ((ch = getopt_long(argc, argv, "fj:m:s:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'f':
+			force = 1;
+			break;
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			for (i = 0; i < sizeof(method_name) / sizeof(method_name[0]); i++) {
+				if (strcmp(optarg, method_name[i]) == 0)
+					break;
+			}
+			if (i == sizeof(method_name) / sizeof(method_name[0])) {
+				xo_warnx("Unknown reset method '%s'", optarg);
+				return;
+			}
+			method = i;
+			break;
+		case 's':
+			sel_str = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	/* Never reset every device in the system by accident */
+	if (sel_str == NULL) {
+		xo_warnx("reset requires a selector");
+		return;
+	}
+
+	pmatch = parse_selector(sel_str);
+	if (pmatch == NULL)
+		return;
+
+	if (nthreads == 0)
+		nthreads = 4 * work_default_threads();
+
+	if (method == RESET_SBR)
+		tree_build();
+
+	iter = pci_slot_match_iterator_create(pmatch);
+
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		struct pci_device *bridge;
+
+		if (method != RESET_SBR) {
+			job = job_add(&jobs, &njobs, method, pdev);
+			job_add_dev(job, pdev);
+			continue;
+		}
+
+		/* Functions below the same bridge share one reset */
+		bridge = tree_parent(pdev);
+		if (bridge == NULL) {
+			job = job_add(&jobs, &njobs, method, pdev);
+			job->skip = "no bridge above";
+			continue;
+		}
+
+		for (i = 0; i < njobs; i++) {
+			if (jobs[i].pdev == bridge)
+				break;
+		}
+		if (i < njobs)
+			continue;
+
+		job = job_add(&jobs, &njobs, method, bridge);
+	}
+
+	pci_iterator_destroy(iter);
+
+	/* A secondary bus reset resets every function on the bus */
+	if (method == RESET_SBR) {
+		iter = pci_slot_match_iterator_create(NULL);
+		while ((pdev = pci_device_next(iter)) != NULL) {
+			struct pci_device *bridge = tree_parent(pdev);
+
+			for (i = 0; i < njobs; i++) {
+				if ((jobs[i].skip == NULL) && (jobs[i].pdev == bridge))
+					job_add_dev(&jobs[i], pdev);
+			}
+		}
+		pci_iterator_destroy(iter);
+	}
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].skip == NULL)
+			jobs[i].skip = reset_check(&jobs[i], force);
+		if (jobs[i].skip == NULL)
+			nreset++;
+	}
+
+	start = now_ns();
+	work_run(njobs, nthreads, reset_run, jobs);
+
+	xo_open_list("reset");
+	for (i = 0; i < njobs; i++)
+		reset_emit(&jobs[i]);
+	xo_close_list("reset");
+
+	xo_emit("{:resets/%u} {L:resets in} {:elapsed/%ju}{U:us}\n",
+			nreset, (uintmax_t)((now_ns() - start) / 1000));
+
+	for (i = 0; i < njobs; i++) {
+		free(jobs[i].devs);
+		free(jobs[i].state);
+	}
+	free(jobs);
+	free(pmatch);
+
+	if (method == RESET_SBR)
+		tree_free();
+}
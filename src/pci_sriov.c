@@ -0,0 +1,240 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SR-IOV Physical Function (PF) tracking
+ *
+ * The Routing IDs of a PF's Virtual Functions (VF) follow from the First
+ * VF Offset and VF Stride in its SR-IOV capability. Recording these for
+ * each PF lets VFs be identified without reading their configuration
+ * space and displayed as a single range under their PF. Where sysfs is
+ * available, only devices the kernel reports as having VFs are read.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <unistd.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+#include "pci_stats.h"
+
+extern void pci_device_get_names(const struct pci_device *pdev,
+		const char **cname, const char **vname, const char **dname);
+
+#define SYSFS_PCI_DEVICES	"/sys/bus/pci/devices"
+
+#define RID(b, d, f)	(((b) << 8) | ((d) << 3) | (f))
+
+struct sriov_pf {
+	struct pci_device *pdev;
+	uint32_t first_rid;
+	uint16_t total_vfs;
+	uint16_t num_vfs;
+	uint16_t offset;
+	uint16_t stride;
+	uint16_t vf_device;
+};
+
+static struct sriov_pf *pfs = NULL;
+static uint32_t npfs = 0;
+
+static struct sriov_pf *
+sriov_find_pf(const struct pci_device *pdev)
+{
+	uint32_t i;
+
+	for (i = 0; i < npfs; i++) {
+		if (pfs[i].pdev == pdev)
+			return &pfs[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Return the PF of a VF or NULL if the device isn't a known VF
+ */
+struct pci_device *
+sriov_vf_parent(const struct pci_device *pdev)
+{
+	uint32_t rid = RID(pdev->bus, pdev->dev, pdev->func);
+	uint32_t i;
+
+	for (i = 0; i < npfs; i++) {
+		struct sriov_pf *pf = &pfs[i];
+
+		if ((pf->pdev->domain != pdev->domain) || (rid < pf->first_rid))
+			continue;
+
+		if ((pf->stride == 0) && (rid == pf->first_rid))
+			return pf->pdev;
+
+		if ((pf->stride != 0) && (((rid - pf->first_rid) % pf->stride) == 0) &&
+				(((rid - pf->first_rid) / pf->stride) < pf->num_vfs))
+			return pf->pdev;
+	}
+
+	return NULL;
+}
+
+/**
+ * Number of VFs the kernel reports as enabled, or -1 if the device isn't
+ * in sysfs and its configuration space must be read instead
+ */
+static int
+sriov_sysfs_numvfs(const struct pci_device *pdev)
+{
+	char path[128];
+	FILE *f;
+	int n = 0;
+
+	snprintf(path, sizeof(path), SYSFS_PCI_DEVICES "/%04x:%02x:%02x.%u",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+	if (access(path, F_OK) != 0)
+		return -1;
+
+	/* Only PFs have the attribute */
+	snprintf(path, sizeof(path), SYSFS_PCI_DEVICES "/%04x:%02x:%02x.%u/sriov_numvfs",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+
+	if (fscanf(f, "%d", &n) != 1)
+		n = 0;
+	fclose(f);
+
+	return n;
+}
+
+/**
+ * Record every PF with enabled VFs among the matching devices (or all
+ * devices if match is NULL)
+ */
+void
+sriov_scan(const struct pci_slot_match *match)
+{
+	struct pci_device_iterator *iter;
+	struct pci_device *pdev;
+
+	iter = pci_slot_match_iterator_create(match);
+
+	while ((pdev = stats_device_next(iter)) != NULL) {
+		struct sriov_pf *pf;
+		uint32_t cap;
+		uint16_t ctl = 0;
+
+		/*
+		 * VFs are enumerated after their PF and don't implement the
+		 * SR-IOV capability, so skip the capability walk for them
+		 */
+		if (sriov_vf_parent(pdev) != NULL)
+			continue;
+
+		if (sriov_sysfs_numvfs(pdev) == 0)
+			continue;
+
+		cap = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_SRIOV);
+		if (cap == 0)
+			continue;
+
+		if (read_cfg(pdev, cap + SRIOV_CTL, &ctl, 2) ||
+				!(ctl & SRIOV_CTL_VFE))
+			continue;
+
+		pf = realloc(pfs, (npfs + 1) * sizeof(struct sriov_pf));
+		if (pf == NULL)
+			err(1, "sriov");
+		pfs = pf;
+		pf = &pfs[npfs];
+
+		pf->pdev = pdev;
+		read_cfg(pdev, cap + SRIOV_TOTAL_VFS, &pf->total_vfs, 2);
+		read_cfg(pdev, cap + SRIOV_NUM_VFS, &pf->num_vfs, 2);
+		read_cfg(pdev, cap + SRIOV_VF_OFFSET, &pf->offset, 2);
+		read_cfg(pdev, cap + SRIOV_VF_STRIDE, &pf->stride, 2);
+		read_cfg(pdev, cap + SRIOV_VF_DID, &pf->vf_device, 2);
+		pf->first_rid = RID(pdev->bus, pdev->dev, pdev->func) + pf->offset;
+
+		if (pf->num_vfs != 0)
+			npfs++;
+	}
+
+	pci_iterator_destroy(iter);
+}
+
+void
+sriov_free(void)
+{
+
+	free(pfs);
+	pfs = NULL;
+	npfs = 0;
+}
+
+/**
+ * Display the VFs of a PF as a range
+ */
+void
+sriov_emit_vfs(const struct pci_device *pdev, uint32_t indent, int verbose)
+{
+	struct sriov_pf *pf = sriov_find_pf(pdev);
+	struct pci_device *vf;
+	uint32_t last;
+
+	if (pf == NULL)
+		return;
+
+	last = pf->first_rid + (pf->num_vfs - 1) * pf->stride;
+
+	xo_open_container("sriov");
+	xo_emit("{P:/%*s}VFs {:first-vf/%04x:%02x:%02x.%u}-{:last-vf/%04x:%02x:%02x.%u} ",
+			indent, "",
+			pdev->domain, pf->first_rid >> 8, (pf->first_rid >> 3) & 0x1f,
+			pf->first_rid & 0x7,
+			pdev->domain, last >> 8, (last >> 3) & 0x1f, last & 0x7);
+	xo_emit("({:numvfs/%u} of {:totalvfs/%u}, stride {:stride/%u}) ",
+			pf->num_vfs, pf->total_vfs, pf->stride);
+
+	vf = pci_device_find_by_slot(pdev->domain, pf->first_rid >> 8,
+			(pf->first_rid >> 3) & 0x1f, pf->first_rid & 0x7);
+
+	if (verbose && (vf != NULL)) {
+		const char *cname = NULL, *vname = NULL, *dname = NULL;
+
+		pci_device_get_names(vf, &cname, &vname, &dname);
+
+		xo_emit("{:vendorname} {:devname}\n", vname, dname);
+	} else {
+		xo_emit("{:vendorid/%04x}:{:deviceid/%04x}\n",
+				pdev->vendor_id, pf->vf_device);
+	}
+
+	xo_close_container("sriov");
+}
@@ -0,0 +1,263 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Configuration state save and restore
+ *
+ * Only the state which commands in this tool can disturb is saved: the
+ * header, the PCI Express control registers, the MSI capability, and the
+ * MSI-X Message Control register. MSI-X tables live in device memory and
+ * are not saved; a reset leaves each vector masked, so restoring the
+ * enable can't generate interrupts to stale addresses.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+#include "pci_state.h"
+
+#define SYSFS_PCI_DEVICES	"/sys/bus/pci/devices"
+
+#define READY_POLL_US		100
+
+/* Recovery time from D3hot to D0 (PCI PM 5.9) */
+#define D3HOT_DELAY_NS		(10 * 1000000ULL)
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int32_t
+pci_state_save(struct pci_device *pdev, struct pci_state *st)
+{
+	uint32_t i;
+	int32_t rc;
+
+	for (i = 0; i < PCI_STATE_HDR_DWORDS; i++) {
+		rc = read_cfg(pdev, i * 4, &st->hdr[i], 4);
+		if (rc)
+			return rc;
+	}
+
+	st->exp = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+	if (st->exp != 0) {
+		read_cfg(pdev, st->exp + PCIE_DEVCTL, &st->devctl, 2);
+		read_cfg(pdev, st->exp + PCIE_LNKCTL, &st->lnkctl, 2);
+		read_cfg(pdev, st->exp + PCIE_DEVCTL2, &st->devctl2, 2);
+		read_cfg(pdev, st->exp + PCIE_LNKCTL2, &st->lnkctl2, 2);
+	}
+
+	st->msi = pci_find_cap(pdev, PCI_CAP_ID_MSI);
+	if (st->msi != 0) {
+		read_cfg(pdev, st->msi + MSI_CTL, &st->msi_ctl, 2);
+		read_cfg(pdev, st->msi + MSI_ADDR_LO, &st->msi_addr_lo, 4);
+		if (st->msi_ctl & MSI_CTL_64BIT)
+			read_cfg(pdev, st->msi + MSI_ADDR_HI, &st->msi_addr_hi, 4);
+		read_cfg(pdev, st->msi + MSI_DATA(st->msi_ctl), &st->msi_data, 2);
+		if (st->msi_ctl & MSI_CTL_PVM)
+			read_cfg(pdev, st->msi + MSI_MASK(st->msi_ctl),
+					&st->msi_mask, 4);
+	}
+
+	st->msix = pci_find_cap(pdev, PCI_CAP_ID_MSIX);
+	if (st->msix != 0)
+		read_cfg(pdev, st->msix + MSI_CTL, &st->msix_ctl, 2);
+
+	return 0;
+}
+
+/**
+ * Restore saved state
+ *
+ * Header dwords are written from the end so that the Command register,
+ * which enables decoding of the restored BARs, is written last. Only
+ * dwords which differ are written.
+ */
+int32_t
+pci_state_restore(struct pci_device *pdev, const struct pci_state *st)
+{
+	uint32_t v;
+	int32_t i, rc = 0;
+
+	if (st->exp != 0) {
+		write_cfg(pdev, st->exp + PCIE_DEVCTL, (void *)&st->devctl, 2);
+		write_cfg(pdev, st->exp + PCIE_LNKCTL, (void *)&st->lnkctl, 2);
+		write_cfg(pdev, st->exp + PCIE_DEVCTL2, (void *)&st->devctl2, 2);
+		write_cfg(pdev, st->exp + PCIE_LNKCTL2, (void *)&st->lnkctl2, 2);
+	}
+
+	for (i = PCI_STATE_HDR_DWORDS - 1; i > 0; i--) {
+		v = 0;
+		rc = read_cfg(pdev, i * 4, &v, 4);
+		if (rc)
+			return rc;
+
+		if (v != st->hdr[i]) {
+			rc = write_cfg(pdev, i * 4, (void *)&st->hdr[i], 4);
+			if (rc)
+				return rc;
+		}
+	}
+
+	/* Program the message before enabling MSI */
+	if (st->msi != 0) {
+		write_cfg(pdev, st->msi + MSI_ADDR_LO, (void *)&st->msi_addr_lo, 4);
+		if (st->msi_ctl & MSI_CTL_64BIT)
+			write_cfg(pdev, st->msi + MSI_ADDR_HI,
+					(void *)&st->msi_addr_hi, 4);
+		write_cfg(pdev, st->msi + MSI_DATA(st->msi_ctl),
+				(void *)&st->msi_data, 2);
+		if (st->msi_ctl & MSI_CTL_PVM)
+			write_cfg(pdev, st->msi + MSI_MASK(st->msi_ctl),
+					(void *)&st->msi_mask, 4);
+		write_cfg(pdev, st->msi + MSI_CTL, (void *)&st->msi_ctl, 2);
+	}
+
+	if (st->msix != 0)
+		write_cfg(pdev, st->msix + MSI_CTL, (void *)&st->msix_ctl, 2);
+
+	return rc;
+}
+
+/**
+ * Write the power state in PMCSR
+ */
+int32_t
+pci_set_power_state(struct pci_device *pdev, uint32_t pmcap, uint16_t state)
+{
+	uint16_t pmcsr = 0;
+	int32_t rc;
+
+	rc = read_cfg(pdev, pmcap + PM_CTRL, &pmcsr, 2);
+	if (rc)
+		return rc;
+
+	/* Writing PME_Status back as 1 would clear it */
+	pmcsr = (pmcsr & ~(PM_CTRL_STATE | PM_CTRL_PME_STATUS)) | state;
+
+	return write_cfg(pdev, pmcap + PM_CTRL, &pmcsr, 2);
+}
+
+/**
+ * Time software must wait after writing D0 to a function in D3hot before
+ * accessing it
+ *
+ * Functions with Immediate Readiness need no wait, and Readiness Time
+ * Reporting gives the time a function actually needs. The source of the
+ * time ("immediate", "rtr" or "spec") is returned in src.
+ */
+uint64_t
+pci_d0_delay(struct pci_device *pdev, uint32_t pmcap, const char **src)
+{
+	uint32_t rtr, r1 = 0, r2 = 0;
+	uint16_t pmc = 0;
+
+	read_cfg(pdev, pmcap + PM_PMC, &pmc, 2);
+	if (pmc & PM_PMC_IMM_READY) {
+		*src = "immediate";
+		return 0;
+	}
+
+	rtr = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_RTR);
+	if (rtr != 0) {
+		read_cfg(pdev, rtr + RTR_1, &r1, 4);
+		read_cfg(pdev, rtr + RTR_2, &r2, 4);
+	}
+
+	if (r1 & RTR_VALID) {
+		*src = "rtr";
+		return RTR_NS(RTR_D3HOT_TIME(r2));
+	}
+
+	*src = "spec";
+
+	return D3HOT_DELAY_NS;
+}
+
+/**
+ * Is a driver bound to the device?
+ */
+int
+pci_driver_bound(struct pci_device *pdev)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path), SYSFS_PCI_DEVICES "/%04x:%02x:%02x.%u/driver",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+
+	return access(path, F_OK) == 0;
+}
+
+/**
+ * Poll until the device responds to configuration requests
+ *
+ * A device which isn't ready returns all ones. VFs always return all
+ * ones for their Vendor ID, so readiness is judged by the Command and
+ * Status registers, which never read as all ones once the device
+ * responds. With Configuration RRS Software Visibility enabled, a device
+ * which isn't ready also returns a Vendor ID of 0x0001.
+ */
+int32_t
+pci_wait_ready(struct pci_device *pdev, uint64_t timeout_ns, uint64_t *elapsed_ns)
+{
+	uint64_t start = now_ns(), now;
+	uint32_t cmdsts;
+	uint16_t vid;
+
+	for (;;) {
+		cmdsts = UINT32_MAX;
+		vid = 0xffff;
+		read_cfg(pdev, PCI_COMMAND, &cmdsts, 4);
+		read_cfg(pdev, PCI_VENDOR_ID, &vid, 2);
+
+		now = now_ns();
+		if ((cmdsts != UINT32_MAX) &&
+				((vid != 0x0001) || (pdev->vendor_id == 0x0001)))
+			break;
+
+		if (now - start > timeout_ns) {
+			*elapsed_ns = now - start;
+			return ETIMEDOUT;
+		}
+
+		usleep(READY_POLL_US);
+	}
+
+	*elapsed_ns = now - start;
+
+	return 0;
+}
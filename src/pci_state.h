@@ -0,0 +1,59 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Save and restore of the configuration state lost when a device is
+ * reset or returns to D0 from D3hot without No Soft Reset
+ */
+
+#define PCI_STATE_HDR_DWORDS	16
+
+struct pci_state {
+	uint32_t hdr[PCI_STATE_HDR_DWORDS];
+	uint32_t exp;		/* PCI Express capability offset or 0 */
+	uint16_t devctl;
+	uint16_t lnkctl;
+	uint16_t devctl2;
+	uint16_t lnkctl2;
+	uint32_t msi;		/* MSI capability offset or 0 */
+	uint16_t msi_ctl;
+	uint32_t msi_addr_lo;
+	uint32_t msi_addr_hi;
+	uint16_t msi_data;
+	uint32_t msi_mask;
+	uint32_t msix;		/* MSI-X capability offset or 0 */
+	uint16_t msix_ctl;
+};
+
+extern int32_t pci_state_save(struct pci_device *pdev, struct pci_state *st);
+extern int32_t pci_state_restore(struct pci_device *pdev, const struct pci_state *st);
+extern int32_t pci_set_power_state(struct pci_device *pdev, uint32_t pmcap,
+		uint16_t state);
+extern uint64_t pci_d0_delay(struct pci_device *pdev, uint32_t pmcap,
+		const char **src);
+extern int pci_driver_bound(struct pci_device *pdev);
+extern int32_t pci_wait_ready(struct pci_device *pdev, uint64_t timeout_ns,
+		uint64_t *elapsed_ns);
@@ -0,0 +1,223 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_stats.h"
+
+#define MAX_NEST	8
+
+static const char *phase_names[STATS_NPHASES] = {
+	[STATS_OTHER]    = "other",
+	[STATS_INIT]     = "pci_system_init",
+	[STATS_ENUM]     = "enumeration",
+	[STATS_TOPOLOGY] = "topology",
+	[STATS_NAMES]    = "names",
+	[STATS_OUTPUT]   = "output",
+};
+
+static int enabled = 0;
+static uint64_t start_ns, last_ns;
+static uint64_t phase_ns[STATS_NPHASES];
+static uint64_t counters[STATS_NCOUNTERS];
+
+/* Phases nest and time is charged to the innermost one */
+static enum stats_phase stack[MAX_NEST];
+static uint32_t depth = 0;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+charge(void)
+{
+	uint64_t now = now_ns();
+
+	phase_ns[depth ? stack[depth - 1] : STATS_OTHER] += now - last_ns;
+	last_ns = now;
+}
+
+static ssize_t
+stats_write(void *opaque, const char *buf)
+{
+	size_t len = strlen(buf);
+
+	stats_begin(STATS_OUTPUT);
+	fwrite(buf, 1, len, stdout);
+	stats_end(STATS_OUTPUT);
+
+	stats_count(STATS_BYTES, len);
+
+	return len;
+}
+
+static int
+stats_flush(void *opaque)
+{
+
+	return fflush(stdout);
+}
+
+/**
+ * Start collecting statistics
+ *
+ * libxo output is routed through a writer which counts and times it
+ */
+void
+stats_enable(void)
+{
+
+	enabled = 1;
+	start_ns = last_ns = now_ns();
+
+	xo_set_writer(NULL, NULL, stats_write, NULL, stats_flush);
+}
+
+void
+stats_begin(enum stats_phase phase)
+{
+
+	if (!enabled || (depth == MAX_NEST))
+		return;
+
+	charge();
+	stack[depth++] = phase;
+}
+
+void
+stats_end(enum stats_phase phase)
+{
+
+	if (!enabled || (depth == 0) || (stack[depth - 1] != phase))
+		return;
+
+	charge();
+	depth--;
+}
+
+void
+stats_count(enum stats_counter c, uint64_t n)
+{
+
+	if (enabled)
+		__atomic_fetch_add(&counters[c], n, __ATOMIC_RELAXED);
+}
+
+void
+stats_count_cfg(int write, uint32_t width)
+{
+
+	switch (width) {
+	case 1:
+		stats_count(write ? STATS_WRITE_1 : STATS_READ_1, 1);
+		break;
+	case 2:
+		stats_count(write ? STATS_WRITE_2 : STATS_READ_2, 1);
+		break;
+	case 4:
+		stats_count(write ? STATS_WRITE_4 : STATS_READ_4, 1);
+		break;
+	}
+}
+
+/**
+ * Timed wrapper around pci_device_next()
+ */
+struct pci_device *
+stats_device_next(struct pci_device_iterator *iter)
+{
+	struct pci_device *pdev;
+
+	stats_begin(STATS_ENUM);
+	pdev = pci_device_next(iter);
+	stats_end(STATS_ENUM);
+
+	return pdev;
+}
+
+void
+stats_report(void)
+{
+	struct rusage ru;
+	uint64_t total;
+	uint32_t i;
+
+	if (!enabled)
+		return;
+
+	charge();
+	total = last_ns - start_ns;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	xo_open_container("stats");
+
+	xo_emit("{T:stats}:\n");
+	xo_emit("  {Lwc:total}{:total-us/%ju}{U:us}\n", (uintmax_t)(total / 1000));
+
+	xo_open_list("phase");
+	for (i = 0; i < STATS_NPHASES; i++) {
+		xo_open_instance("phase");
+		xo_emit("  {k:name/%s}: {:time-us/%ju}{U:us}\n", phase_names[i],
+				(uintmax_t)(phase_ns[i] / 1000));
+		xo_close_instance("phase");
+	}
+	xo_close_list("phase");
+
+	xo_emit("  {Lwc:config reads}{Lw:byte}{:reads-1/%ju} {Lw:word}{:reads-2/%ju} "
+			"{Lw:dword}{:reads-4/%ju} {Lw:range}{:reads-range/%ju}\n",
+			(uintmax_t)counters[STATS_READ_1],
+			(uintmax_t)counters[STATS_READ_2],
+			(uintmax_t)counters[STATS_READ_4],
+			(uintmax_t)counters[STATS_READ_RANGE]);
+	xo_emit("  {Lwc:config writes}{Lw:byte}{:writes-1/%ju} {Lw:word}{:writes-2/%ju} "
+			"{Lw:dword}{:writes-4/%ju}\n",
+			(uintmax_t)counters[STATS_WRITE_1],
+			(uintmax_t)counters[STATS_WRITE_2],
+			(uintmax_t)counters[STATS_WRITE_4]);
+	xo_emit("  {Lwc:name lookups}{:name-lookups/%ju} {Lwc:cache hits}{:name-hits/%ju}\n",
+			(uintmax_t)counters[STATS_NAME_LOOKUP],
+			(uintmax_t)counters[STATS_NAME_HIT]);
+	xo_emit("  {Lwc:bytes emitted}{:bytes/%ju}\n",
+			(uintmax_t)counters[STATS_BYTES]);
+	xo_emit("  {Lwc:peak RSS}{:max-rss-kb/%ld}{U:KiB}\n", ru.ru_maxrss);
+
+	xo_close_container("stats");
+}
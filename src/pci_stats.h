@@ -0,0 +1,62 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Run time statistics (--stats)
+ */
+
+enum stats_phase {
+	STATS_OTHER,
+	STATS_INIT,
+	STATS_ENUM,
+	STATS_TOPOLOGY,
+	STATS_NAMES,
+	STATS_OUTPUT,
+	STATS_NPHASES
+};
+
+enum stats_counter {
+	STATS_READ_1,
+	STATS_READ_2,
+	STATS_READ_4,
+	STATS_READ_RANGE,
+	STATS_WRITE_1,
+	STATS_WRITE_2,
+	STATS_WRITE_4,
+	STATS_NAME_LOOKUP,
+	STATS_NAME_HIT,
+	STATS_BYTES,
+	STATS_NCOUNTERS
+};
+
+extern void stats_enable(void);
+extern void stats_begin(enum stats_phase phase);
+extern void stats_end(enum stats_phase phase);
+extern void stats_count(enum stats_counter c, uint64_t n);
+extern void stats_count_cfg(int write, uint32_t width);
+extern void stats_report(void);
+
+extern struct pci_device *stats_device_next(struct pci_device_iterator *iter);
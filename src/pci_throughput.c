@@ -0,0 +1,261 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Effective link throughput model
+ *
+ * Estimates the DMA bandwidth an endpoint can achieve over its link from
+ * the negotiated speed and width and the programmed Max Payload Size
+ * (MPS) and Max Read Request Size (MRRS). The model charges each TLP its
+ * framing, sequence number, LCRC and header, amortizes the Ack and flow
+ * control DLLPs over the TLPs, splits read data into completions of at
+ * most MPS bytes on Read Completion Boundaries, and limits reads by the
+ * number of requests the available tags keep outstanding.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+
+void throughput_emit(struct pci_device *pdev, uint32_t indent);
+
+/* TLP headers: 64-bit memory requests use 4 DW, completions 3 DW */
+#define HDR_MEM		16
+#define HDR_CPL		12
+
+/* Sequence number and LCRC added by the data link layer */
+#define DLL_OVERHEAD	6
+
+/* One Ack and one UpdateFC DLLP (8 bytes each) per this many TLPs */
+#define DLLP_BYTES	8
+#define DLLP_TLPS	4
+
+/* Assumed memory read round trip used to bound outstanding reads */
+#define READ_RTT_NS	1000
+
+/* Flag configurations leaving more than this share of the link unused */
+#define LOSS_PCT	10
+
+#define MAX_MRRS	4096
+#define MAX_PATH	256
+
+struct link_gen {
+	uint32_t framing;	/* per TLP, 0 in Flit Mode */
+	int flit;
+};
+
+/* Framing per link speed, lane bandwidth is in pcie_lane_mbps */
+static const struct link_gen gens[PCIE_NUM_SPEEDS] = {
+	{ 0, 0 },
+	{ 2, 0 },
+	{ 2, 0 },
+	{ 4, 0 },
+	{ 4, 0 },
+	{ 4, 0 },
+	{ 0, 1 },
+};
+
+struct tput {
+	uint32_t write_mbps;
+	uint32_t read_mbps;
+};
+
+/**
+ * Bytes a TLP carrying the given payload occupies on the link
+ */
+static uint32_t
+tlp_bytes(const struct link_gen *g, uint32_t hdr, uint32_t payload)
+{
+
+	if (g->flit)
+		return hdr + payload;
+
+	return g->framing + DLL_OVERHEAD + hdr + payload +
+		(2 * DLLP_BYTES) / DLLP_TLPS;
+}
+
+static void
+tput_model(const struct link_gen *g, uint32_t link_mbps, uint32_t mps,
+		uint32_t mrrs, uint32_t rcb, uint32_t tags, struct tput *t)
+{
+	uint32_t cpl, ncpl;
+	uint64_t tag_mbps;
+
+	t->write_mbps = (uint64_t)link_mbps * mps / tlp_bytes(g, HDR_MEM, mps);
+
+	/* Completions carry up to MPS bytes and end on an RCB boundary */
+	cpl = mps < mrrs ? mps : mrrs;
+	if (cpl > rcb)
+		cpl -= cpl % rcb;
+	ncpl = (mrrs + cpl - 1) / cpl;
+
+	t->read_mbps = (uint64_t)link_mbps * mrrs /
+		(ncpl * tlp_bytes(g, HDR_CPL, 0) + mrrs);
+
+	/* Bytes per microsecond equal MB/s */
+	tag_mbps = (uint64_t)tags * mrrs * 1000 / READ_RTT_NS;
+	if (tag_mbps < t->read_mbps)
+		t->read_mbps = tag_mbps;
+}
+
+/**
+ * Top of a device's hierarchy
+ */
+static struct pci_device *
+hier_root(struct pci_device *pdev)
+{
+	struct pci_device *p;
+	uint32_t depth = 0;
+
+	for (p = tree_parent(pdev); (p != NULL) && (depth < MAX_PATH);
+			p = tree_parent(p), depth++)
+		pdev = p;
+
+	return pdev;
+}
+
+/**
+ * Largest MPS every device in the hierarchy supports
+ *
+ * MPS must be the same for every function below a root port, so siblings
+ * of the path limit it as much as the bridges above the device do.
+ */
+static uint32_t
+best_mps(struct pci_device *pdev)
+{
+	struct pci_device_iterator *iter;
+	struct pci_device *root, *p;
+	uint32_t mpss = 5;
+
+	root = hier_root(pdev);
+
+	iter = pci_slot_match_iterator_create(NULL);
+	while ((p = pci_device_next(iter)) != NULL) {
+		uint32_t cap, devcap = 0;
+
+		if (hier_root(p) != root)
+			continue;
+
+		cap = pci_find_cap(p, PCI_CAP_ID_EXP);
+		if (cap == 0)
+			continue;
+
+		read_cfg(p, cap + PCIE_DEVCAP, &devcap, 4);
+		if (PCIE_DEVCAP_MPSS(devcap) < mpss)
+			mpss = PCIE_DEVCAP_MPSS(devcap);
+	}
+	pci_iterator_destroy(iter);
+
+	return 128 << mpss;
+}
+
+/**
+ * Display the modeled read and write bandwidth of an endpoint's link
+ * and what the largest supported MPS and MRRS would achieve
+ */
+void
+throughput_emit(struct pci_device *pdev, uint32_t indent)
+{
+	const struct link_gen *g;
+	struct tput now, best;
+	uint32_t cap, link_mbps, mps, mrrs, rcb, tags, loss, max_mps;
+	uint16_t caps = 0, devctl = 0, devctl2 = 0, lnkctl = 0, lnksta = 0;
+
+	cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+	if (cap == 0)
+		return;
+
+	read_cfg(pdev, cap + PCIE_CAPS, &caps, 2);
+	if ((PCIE_CAPS_TYPE(caps) != PCIE_TYPE_ENDPOINT) &&
+			(PCIE_CAPS_TYPE(caps) != PCIE_TYPE_LEG_ENDPOINT))
+		return;
+
+	read_cfg(pdev, cap + PCIE_DEVCTL, &devctl, 2);
+	read_cfg(pdev, cap + PCIE_DEVCTL2, &devctl2, 2);
+	read_cfg(pdev, cap + PCIE_LNKCTL, &lnkctl, 2);
+	read_cfg(pdev, cap + PCIE_LNKSTA, &lnksta, 2);
+
+	/* VFs have no link of their own */
+	if ((PCIE_LNKSTA_SPEED(lnksta) == 0) ||
+			(PCIE_LNKSTA_SPEED(lnksta) >= PCIE_NUM_SPEEDS) ||
+			(PCIE_LNKSTA_WIDTH(lnksta) == 0))
+		return;
+
+	g = &gens[PCIE_LNKSTA_SPEED(lnksta)];
+	link_mbps = pcie_lane_mbps[PCIE_LNKSTA_SPEED(lnksta)] *
+			PCIE_LNKSTA_WIDTH(lnksta);
+
+	mps = 128 << ((devctl & PCIE_DEVCTL_MPS) >> PCIE_DEVCTL_MPS_SHIFT);
+	mrrs = 128 << ((devctl & PCIE_DEVCTL_MRRS) >> PCIE_DEVCTL_MRRS_SHIFT);
+	rcb = lnkctl & PCIE_LNKCTL_RCB ? 128 : 64;
+
+	if (devctl2 & PCIE_DEVCTL2_10BIT_TAG_REQ)
+		tags = 768;
+	else if (devctl & PCIE_DEVCTL_EXT_TAG)
+		tags = 256;
+	else
+		tags = 32;
+
+	tput_model(g, link_mbps, mps, mrrs, rcb, tags, &now);
+	max_mps = best_mps(pdev);
+	tput_model(g, link_mbps, max_mps, MAX_MRRS, rcb, tags, &best);
+
+	xo_open_container("throughput");
+
+	xo_emit("{P:/%*s}Gen{:speed/%u} x{:width/%u} {:link-mbps/%u} MB/s "
+			"MPS {:mps/%u} MRRS {:mrrs/%u}: "
+			"write {:write-mbps/%u} MB/s read {:read-mbps/%u} MB/s\n",
+			indent, "",
+			PCIE_LNKSTA_SPEED(lnksta), PCIE_LNKSTA_WIDTH(lnksta),
+			link_mbps, mps, mrrs, now.write_mbps, now.read_mbps);
+
+	/* Programmed values above what the hierarchy supports gain nothing */
+	loss = 0;
+	if (best.write_mbps > now.write_mbps)
+		loss = best.write_mbps - now.write_mbps;
+	if ((best.read_mbps > now.read_mbps) &&
+			(best.read_mbps - now.read_mbps > loss))
+		loss = best.read_mbps - now.read_mbps;
+
+	if ((uint64_t)loss * 100 > (uint64_t)link_mbps * LOSS_PCT) {
+		xo_emit("{P:/%*s}{:status/%s}: {:unused-pct/%u}% "
+				"of the link unused, MPS {:best-mps/%u} MRRS "
+				"{:best-mrrs/%u} would give write "
+				"{:best-write-mbps/%u} MB/s read "
+				"{:best-read-mbps/%u} MB/s\n",
+				indent, "", "MPS/MRRS limited",
+				(uint32_t)((uint64_t)loss * 100 / link_mbps),
+				max_mps, MAX_MRRS,
+				best.write_mbps, best.read_mbps);
+	}
+
+	xo_close_container("throughput");
+}
@@ -0,0 +1,473 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Configuration access tracing (--trace)
+ *
+ * Every access made through read_cfg() / write_cfg() is recorded in a
+ * memory mapped ring buffer file consisting of a header followed by a
+ * fixed number of records. When the ring is full, the oldest records are
+ * overwritten.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern void usage(void);
+
+#define TRACE_MAGIC	"PCITRACE"
+#define TRACE_VERSION	1
+#define TRACE_RECORDS	(256 * 1024)
+#define TRACE_BUCKETS	32	/* log2(ns) latency histogram buckets */
+
+#define TRACE_READ	0
+#define TRACE_WRITE	1
+
+struct trace_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint64_t capacity;	/* number of records in the ring */
+	uint64_t count;		/* total number of records written */
+};
+
+struct trace_rec {
+	uint64_t ts_ns;		/* CLOCK_MONOTONIC time the access started */
+	uint32_t latency_ns;
+	uint32_t value;		/* or the length of a range read */
+	int32_t result;
+	uint16_t domain;
+	uint16_t offset;
+	uint8_t bus;
+	uint8_t devfn;
+	uint8_t width;		/* 0 for range reads */
+	uint8_t op;
+	uint32_t reserved;
+};
+
+static struct trace_hdr *trace_hdr = NULL;
+static struct trace_rec *trace_ring = NULL;
+static size_t trace_len = 0;
+
+static struct option opts[] = {
+	{ "write", no_argument, NULL, 'w'},
+	{ NULL, 0, NULL, 0 }
+};
+
+static uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Create a trace file and start recording accesses to it
+ */
+int32_t
+trace_open(const char *path)
+{
+	int fd;
+	void *va;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return errno;
+	}
+
+	trace_len = sizeof(struct trace_hdr) +
+		TRACE_RECORDS * sizeof(struct trace_rec);
+
+	if (ftruncate(fd, trace_len)) {
+		close(fd);
+		return errno;
+	}
+
+	va = mmap(NULL, trace_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (va == MAP_FAILED) {
+		return errno;
+	}
+
+	trace_hdr = va;
+	trace_ring = (struct trace_rec *)(trace_hdr + 1);
+
+	memcpy(trace_hdr->magic, TRACE_MAGIC, sizeof(trace_hdr->magic));
+	trace_hdr->version = TRACE_VERSION;
+	trace_hdr->rec_size = sizeof(struct trace_rec);
+	trace_hdr->capacity = TRACE_RECORDS;
+	trace_hdr->count = 0;
+
+	return 0;
+}
+
+void
+trace_close(void)
+{
+
+	if (trace_hdr != NULL) {
+		munmap(trace_hdr, trace_len);
+		trace_hdr = NULL;
+		trace_ring = NULL;
+	}
+}
+
+/**
+ * Return the start time of an access or 0 if tracing is disabled
+ */
+uint64_t
+trace_start(void)
+{
+
+	return trace_hdr ? trace_now() : 0;
+}
+
+/**
+ * Record an access started at time start
+ */
+void
+trace_access(struct pci_device *pdev, int write, uint32_t off, uint32_t width,
+		const void *v, int32_t rc, uint64_t start)
+{
+	struct trace_rec *r;
+	uint64_t slot;
+
+	if (trace_hdr == NULL)
+		return;
+
+	slot = __atomic_fetch_add(&trace_hdr->count, 1, __ATOMIC_RELAXED);
+	r = &trace_ring[slot % trace_hdr->capacity];
+
+	r->ts_ns = start;
+	r->latency_ns = trace_now() - start;
+	r->value = 0;
+	if (width == 0)
+		r->value = *((const uint32_t *)v);
+	else if (v != NULL)
+		memcpy(&r->value, v, width);
+	r->result = rc;
+	r->domain = pdev->domain;
+	r->offset = off;
+	r->bus = pdev->bus;
+	r->devfn = (pdev->dev << 3) | pdev->func;
+	r->width = width;
+	r->op = write ? TRACE_WRITE : TRACE_READ;
+	r->reserved = 0;
+}
+
+/**
+ * Map a trace file and return its records in the order they were written
+ */
+static struct trace_rec *
+trace_load(const char *path, uint64_t *nrec)
+{
+	struct trace_hdr *hdr;
+	struct trace_rec *recs, *ring;
+	struct stat sb;
+	uint64_t n, first, i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", path);
+	}
+
+	if (fstat(fd, &sb) || (sb.st_size < (off_t)sizeof(struct trace_hdr))) {
+		errx(1, "%s: not a trace file", path);
+	}
+
+	hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		err(1, "%s", path);
+	}
+
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+			(hdr->version != TRACE_VERSION) ||
+			(hdr->rec_size != sizeof(struct trace_rec)) ||
+			(hdr->capacity == 0) ||
+			/* capacity * rec_size may wrap */
+			(hdr->capacity > ((uint64_t)sb.st_size -
+				sizeof(struct trace_hdr)) / hdr->rec_size)) {
+		errx(1, "%s: not a trace file", path);
+	}
+
+	ring = (struct trace_rec *)(hdr + 1);
+	n = hdr->count < hdr->capacity ? hdr->count : hdr->capacity;
+	first = hdr->count < hdr->capacity ? 0 : hdr->count % hdr->capacity;
+
+	recs = malloc(n * sizeof(struct trace_rec) + 1);
+	if (recs == NULL) {
+		err(1, "trace");
+	}
+
+	for (i = 0; i < n; i++) {
+		recs[i] = ring[(first + i) % hdr->capacity];
+	}
+
+	munmap(hdr, sb.st_size);
+
+	*nrec = n;
+
+	return recs;
+}
+
+static uint32_t
+bucket(uint32_t ns)
+{
+	uint32_t b = 0;
+
+	while ((ns >>= 1) != 0)
+		b++;
+
+	return b;
+}
+
+static uint64_t
+dev_key(const struct trace_rec *r)
+{
+
+	return ((uint64_t)r->domain << 16) | (r->bus << 8) | r->devfn;
+}
+
+static uint64_t
+reg_key(const struct trace_rec *r)
+{
+
+	return ((uint64_t)r->offset << 8) | r->width;
+}
+
+static int
+dev_cmp(const void *a, const void *b)
+{
+	uint64_t ka = dev_key(a), kb = dev_key(b);
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+static int
+reg_cmp(const void *a, const void *b)
+{
+	uint64_t ka = reg_key(a), kb = reg_key(b);
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+/**
+ * Display a latency histogram of the records [first, last)
+ */
+static void
+emit_histogram(const struct trace_rec *first, const struct trace_rec *last)
+{
+	uint64_t hist[TRACE_BUCKETS] = { 0 };
+	uint64_t sum = 0, n = last - first;
+	uint32_t min = UINT32_MAX, max = 0, i;
+	const struct trace_rec *r;
+
+	for (r = first; r < last; r++) {
+		hist[bucket(r->latency_ns)]++;
+		sum += r->latency_ns;
+		if (r->latency_ns < min)
+			min = r->latency_ns;
+		if (r->latency_ns > max)
+			max = r->latency_ns;
+	}
+
+	xo_emit(" {Lw:count}{:count/%ju} {Lw:min}{:min/%u}{U:ns} "
+			"{Lw:mean}{:mean/%ju}{U:ns} {Lw:max}{:max/%u}{U:ns}\n",
+			(uintmax_t)n, min, (uintmax_t)(sum / n), max);
+
+	xo_open_list("bucket");
+	for (i = 0; i < TRACE_BUCKETS; i++) {
+		if (hist[i] == 0)
+			continue;
+
+		xo_open_instance("bucket");
+		xo_emit("{P:        }{:low/%ju}{U:ns} - {:high/%ju}{U:ns}: {:count/%ju}\n",
+				(uintmax_t)(i ? 1ULL << i : 0), (uintmax_t)(2ULL << i) - 1,
+				(uintmax_t)hist[i]);
+		xo_close_instance("bucket");
+	}
+	xo_close_list("bucket");
+}
+
+/**
+ * Show per-device and per-register latency histograms
+ */
+static void
+trace_report(struct trace_rec *recs, uint64_t n)
+{
+	struct trace_rec *r, *run;
+
+	if (n == 0)
+		return;
+
+	qsort(recs, n, sizeof(struct trace_rec), dev_cmp);
+
+	xo_open_list("device");
+	for (run = r = recs; r <= recs + n; r++) {
+		if ((r < recs + n) && (dev_key(r) == dev_key(run)))
+			continue;
+
+		xo_open_instance("device");
+		xo_emit("{k:bdf/%04x:%02x:%02x.%u}", run->domain, run->bus,
+				run->devfn >> 3, run->devfn & 7);
+		emit_histogram(run, r);
+		xo_close_instance("device");
+		run = r;
+	}
+	xo_close_list("device");
+
+	qsort(recs, n, sizeof(struct trace_rec), reg_cmp);
+
+	xo_open_list("register");
+	for (run = r = recs; r <= recs + n; r++) {
+		if ((r < recs + n) && (reg_key(r) == reg_key(run)))
+			continue;
+
+		xo_open_instance("register");
+		if (run->width)
+			xo_emit("{k:offset/%#x}.{k:width/%u}", run->offset, run->width);
+		else
+			xo_emit("{k:offset/%#x}.{k:width/range}", run->offset);
+		emit_histogram(run, r);
+		xo_close_instance("register");
+		run = r;
+	}
+	xo_close_list("register");
+}
+
+/**
+ * Repeat the traced accesses and report reads returning different values
+ *
+ * Combined with --backend=ecam:<file>, this replays the trace against a
+ * snapshot of configuration space. Writes are only repeated if requested.
+ */
+static void
+trace_replay(struct trace_rec *recs, uint64_t n, int writes)
+{
+	uint64_t i, replayed = 0, skipped = 0, differ = 0;
+
+	xo_open_list("mismatch");
+	for (i = 0; i < n; i++) {
+		struct trace_rec *r = &recs[i];
+		struct pci_device *pdev;
+		uint32_t v = r->value;
+		int32_t rc;
+
+		pdev = pci_device_find_by_slot(r->domain, r->bus, r->devfn >> 3,
+				r->devfn & 7);
+		if ((pdev == NULL) || (r->width == 0) ||
+				((r->op == TRACE_WRITE) && !writes)) {
+			skipped++;
+			continue;
+		}
+
+		replayed++;
+
+		if (r->op == TRACE_WRITE) {
+			write_cfg(pdev, r->offset, &v, r->width);
+			continue;
+		}
+
+		v = 0;
+		rc = read_cfg(pdev, r->offset, &v, r->width);
+		if ((rc != r->result) || (!rc && (v != r->value))) {
+			differ++;
+			xo_open_instance("mismatch");
+			xo_emit("{k:bdf/%04x:%02x:%02x.%u} {:offset/%#x}.{:width/%u} "
+					"{Lw:traced}{:traced/%#x} {Lw:replayed}{:replayed/%#x}\n",
+					r->domain, r->bus, r->devfn >> 3, r->devfn & 7,
+					r->offset, r->width, r->value, v);
+			xo_close_instance("mismatch");
+		}
+	}
+	xo_close_list("mismatch");
+
+	xo_emit("{:replayed/%ju} {L:accesses replayed,} {:skipped/%ju} {L:skipped,} "
+			"{:mismatches/%ju} {L:reads differ}\n",
+			(uintmax_t)replayed, (uintmax_t)skipped, (uintmax_t)differ);
+}
+
+/**
+ * Analyze a configuration access trace
+ */
+void
+trace(int argc, char *argv[])
+{
+	struct trace_rec *recs;
+	uint64_t n = 0;
+	int ch, writes = 0;
+
+	while ((ch = getopt_long(argc, argv, "w", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'w':
+			writes = 1;
+			break;
+		default:
+			return;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) {
+		usage();
+		return;
+	}
+
+	/* Don't trace the analysis of a trace */
+	trace_close();
+
+	recs = trace_load(argv[1], &n);
+
+	if (strcmp(argv[0], "report") == 0) {
+		trace_report(recs, n);
+	} else if (strcmp(argv[0], "replay") == 0) {
+		trace_replay(recs, n, writes);
+	} else {
+		usage();
+	}
+
+	free(recs);
+}
@@ -24,18 +24,60 @@
  * SUCH DAMAGE.
  */
 
+#include <stdlib.h>
 #include <getopt.h>
 #include <libxo/xo.h>
 #include <pciaccess.h>
 #include <sys/queue.h>
 
-extern const char *pci_device_get_class_name( const struct pci_device * );
+#include "pci_stats.h"
+
+extern void pci_device_get_names(const struct pci_device *pdev,
+		const char **cname, const char **vname, const char **dname);
+
+extern struct pci_slot_match *parse_selector(const char *s);
+
+extern void sriov_scan(const struct pci_slot_match *match);
+extern struct pci_device *sriov_vf_parent(const struct pci_device *pdev);
+extern void sriov_emit_vfs(const struct pci_device *pdev, uint32_t indent, int verbose);
+extern void sriov_free(void);
+
+extern void bars_emit(struct pci_device *pdev, uint32_t indent);
+extern void throughput_emit(struct pci_device *pdev, uint32_t indent);
+
+struct fields;
+struct field_rec;
+extern struct fields *fields_parse(const char *spec, const char *sort);
+extern struct field_rec *fields_rec(struct pci_device *pdev);
+extern void fields_emit(struct fields *f, struct field_rec *r);
 
 static struct option opts[] = {
+	{ "ancestors", no_argument, NULL, 'a'},
+	{ "bars", no_argument, NULL, 'b'},
+	{ "depth", required_argument, NULL, 'd'},
+	{ "expand", no_argument, NULL, 'e'},
+	{ "fields", required_argument, NULL, 'f'},
 	{ "number", no_argument, NULL, 'n'},
+	{ "selector", required_argument, NULL, 's'},
+	{ "throughput", no_argument, NULL, 't'},
 	{ NULL, 0, NULL, 0 }
 };
 
+/* Fields to display in place of the default set, if any */
+static struct fields *fields = NULL;
+
+/* Display the address map of each device */
+static int show_bars = 0;
+
+/* Display the modeled bandwidth of each endpoint */
+static int show_throughput = 0;
+
+/* Number of bus levels to display or 0 for all */
+static uint32_t max_depth = 0;
+
+#define MAX_BUS_DEPTH		256
+#define PCI_CLASS_BRIDGE_PCI	0x0604
+
 STAILQ_HEAD(bus_list_s, bus_s) hostbus = STAILQ_HEAD_INITIALIZER(hostbus);
 struct bus_list_s buses = STAILQ_HEAD_INITIALIZER(buses);
 
@@ -55,33 +97,189 @@ struct pdev_s {
 static struct bus_s *get_bus(struct bus_list_s *bl, uint8_t id);
 static struct bus_s *add_bus(struct bus_list_s *bl, uint8_t id, struct pci_device *parent);
 static struct pdev_s *add_device(struct bus_s *bus, struct pci_device *pdev);
-static void print_bus_tree(struct bus_s *b, uint32_t depth, int verbose);
+static int bus_visible(struct bus_s *b, int expand);
+static void print_bus_tree(struct bus_s *b, uint32_t depth, int verbose, int expand);
+static void print_device(struct pci_device *pdev, uint32_t depth, int verbose, int expand);
+static void print_subtree(struct pci_device *pdev, int verbose, int expand);
+static void print_ancestors(struct pci_device *pdev, int verbose);
 static void free_bus_list(struct bus_list_s *bl);
+static void tree_scan(struct pci_device_iterator *iter);
+
+void tree_build(void);
+static void tree_build_range(struct pci_device *bridge);
+struct pci_device *tree_parent(const struct pci_device *pdev);
+void tree_free(void);
 
 void
 devtree(int argc, char *argv[])
 {
-	struct pci_device_iterator *iter;
-	struct pci_device *pdev;
-	struct bus_s *b;
-	int ch, verbose = 1;
+	struct pci_slot_match *pmatch = NULL;
+	struct pci_device *pdev = NULL;
+	const char *sel_str = NULL;
+	int ch, verbose = 1, expand = 0, ancestors = 0;
 
-	while ((ch = getopt_long(argc, argv, "n", opts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "abd:ef:ns:t", opts, NULL)) != -1) {
 		switch (ch) {
+		case 'a':
+			ancestors = 1;
+			break;
+		case 'b':
+			show_bars = 1;
+			break;
+		case 'd':
+			max_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			expand = 1;
+			break;
+		case 'f':
+			fields = fields_parse(optarg, NULL);
+			if (fields == NULL)
+				return;
+			break;
 		case 'n':
 			verbose = 0;
 			break;
+		case 's':
+			sel_str = optarg;
+			break;
+		case 't':
+			show_throughput = 1;
+			break;
 		default:
-			return;
+			goto out;
 		}
 	}
 
+	if (sel_str != NULL) {
+		struct pci_device_iterator *iter;
+
+		pmatch = parse_selector(sel_str);
+		if (pmatch == NULL)
+			goto out;
+
+		iter = pci_slot_match_iterator_create(pmatch);
+		pdev = pci_device_next(iter);
+		pci_iterator_destroy(iter);
+
+		if (pdev == NULL) {
+			xo_warnx("No device matches '%s'", sel_str);
+			goto out;
+		}
+	} else if (ancestors) {
+		xo_warnx("--ancestors requires a selector");
+		goto out;
+	}
+
+	xo_attr("id", "%04x", pdev ? pdev->domain : 0);
+	xo_open_container("domain");
+
+	xo_open_list("bus");
+
+	if (ancestors) {
+		print_ancestors(pdev, verbose);
+	} else if (pdev != NULL) {
+		print_subtree(pdev, verbose, expand);
+	} else {
+		struct bus_s *hb = NULL;
+
+		tree_build();
+
+		if (!expand)
+			sriov_scan(NULL);
+
+		STAILQ_FOREACH(hb, &hostbus, entries) {
+			struct bus_s *b = get_bus(&buses, hb->bus);
+
+			/* VFs may live on buses no bridge forwards to */
+			if (bus_visible(b, expand))
+				print_bus_tree(b, 1, verbose, expand);
+		}
+	}
+
+	xo_close_list("bus");
+
+	xo_close_container("domain");
+
+	sriov_free();
+	tree_free();
+
+out:
+	free(pmatch);
+	free(fields);
+	fields = NULL;
+	show_bars = 0;
+	show_throughput = 0;
+	max_depth = 0;
+}
+
+/**
+ * Build the PCI hierarchy from all devices in the system
+ */
+void
+tree_build(void)
+{
+	struct pci_device_iterator *iter;
+
+	stats_begin(STATS_TOPOLOGY);
+
 	iter = pci_slot_match_iterator_create(NULL);
+	tree_scan(iter);
+	pci_iterator_destroy(iter);
+
+	stats_end(STATS_TOPOLOGY);
+}
+
+/**
+ * Build the hierarchy below a bridge
+ *
+ * Only the buses from the bridge's secondary to subordinate bus are
+ * enumerated.
+ */
+static void
+tree_build_range(struct pci_device *bridge)
+{
+	const struct pci_bridge_info *binfo;
+	struct pci_device_iterator *iter;
+	struct pci_slot_match match;
+	uint32_t bus;
+
+	binfo = pci_device_get_bridge_info(bridge);
+	if ((binfo == NULL) || (binfo->secondary_bus == 0))
+		return;
+
+	stats_begin(STATS_TOPOLOGY);
+
+	/* Bridges found below will claim their own buses */
+	for (bus = binfo->secondary_bus; bus <= binfo->subordinate_bus; bus++)
+		add_bus(&buses, bus, bridge);
+
+	match.domain = bridge->domain;
+	match.dev = PCI_MATCH_ANY;
+	match.func = PCI_MATCH_ANY;
+	match.match_data = 0;
+
+	for (bus = binfo->secondary_bus; bus <= binfo->subordinate_bus; bus++) {
+		match.bus = bus;
+
+		iter = pci_slot_match_iterator_create(&match);
+		tree_scan(iter);
+		pci_iterator_destroy(iter);
+	}
+
+	stats_end(STATS_TOPOLOGY);
+}
+
+/**
+ * Add the devices returned by an iterator to the PCI hierarchy
+ */
+static void
+tree_scan(struct pci_device_iterator *iter)
+{
+	struct pci_device *pdev;
+	struct bus_s *b;
 
-	/*
-	 * Loop through all devices to create the PCI hierarchy
-	 */
-	while ((pdev = pci_device_next(iter)) != NULL) {
+	while ((pdev = stats_device_next(iter)) != NULL) {
 		b = get_bus(&buses, pdev->bus);
 		if (b == NULL) {
 			add_bus(&hostbus, pdev->bus, NULL);
@@ -108,26 +306,25 @@ devtree(int argc, char *argv[])
 
 		add_device(b, pdev);
 	}
+}
 
-	/*
-	 * Print the bus tree
-	 */
-	struct bus_s *hb = NULL;
-
-	xo_attr("id", "%04x", 0);
-	xo_open_container("domain");
-
-	xo_open_list("bus");
-
-	STAILQ_FOREACH(hb, &hostbus, entries) {
-		print_bus_tree(get_bus(&buses, hb->bus), 1, verbose);
-	}
+/**
+ * Return the bridge upstream of a device or NULL for devices on a host bus
+ */
+struct pci_device *
+tree_parent(const struct pci_device *pdev)
+{
+	struct bus_s *b = get_bus(&buses, pdev->bus);
 
-	xo_close_list("bus");
+	return b ? b->parent : NULL;
+}
 
-	xo_close_container("domain");
+void
+tree_free(void)
+{
 
 	free_bus_list(&buses);
+	free_bus_list(&hostbus);
 }
 
 static struct bus_s *
@@ -176,62 +373,244 @@ add_device(struct bus_s *bus, struct pci_device *device)
 	return p;
 }
 
-static void
-print_bus_tree(struct bus_s *b, uint32_t depth, int verbose)
+/**
+ * Does the bus have any devices which aren't shown as part of a VF range?
+ */
+static int
+bus_visible(struct bus_s *b, int expand)
 {
 	struct pdev_s *d = NULL;
 
-	xo_attr("id", "%04x", b->bus);
+	if (expand)
+		return 1;
+
+	STAILQ_FOREACH(d, &b->devices, entries) {
+		if (sriov_vf_parent(d->dev) == NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+print_bus_open(uint16_t domain, uint8_t bus, uint32_t depth)
+{
+
+	xo_attr("id", "%04x", bus);
 	xo_open_instance("bus");
 
 	xo_emit("{P:/%*s}{L:/%04x:%02x} =>\n",
-			(depth - 1) * 4, "",
-			b->parent ? b->parent->domain : 0, b->bus);
+			(depth - 1) * 4, "", domain, bus);
 
 	xo_open_list("device");
+}
 
-	STAILQ_FOREACH(d, &b->devices, entries) {
-		struct pci_device *pdev = d->dev;
+static void
+print_bus_close(void)
+{
 
-		xo_open_instance("device");
+	xo_close_list("device");
 
+	xo_close_instance("bus");
+}
+
+static void
+print_device_line(struct pci_device *pdev, uint32_t depth, int verbose)
+{
+
+	if (fields != NULL) {
+		struct field_rec *r = fields_rec(pdev);
+
+		xo_emit("{P:/%*s}", depth * 4, "");
+		fields_emit(fields, r);
+		free(r);
+	} else if (!verbose) {
 		xo_emit("{P:/%*s}{k:bdf/%04x:%02x:%02x.%u} ",
 				depth * 4, "",
 				pdev->domain, pdev->bus, pdev->dev, pdev->func);
+		xo_emit("{k:vendorid/%04x}:{k:deviceid/%04x} {k:subvendorid/%04x}:{k:subdeviceid/%04x}\n",
+				pdev->vendor_id, pdev->device_id,
+				pdev->subvendor_id, pdev->subdevice_id);
+	} else {
+		const char *cname = NULL, *vname = NULL, *dname = NULL;
+
+		xo_emit("{P:/%*s}{k:bdf/%04x:%02x:%02x.%u} ",
+				depth * 4, "",
+				pdev->domain, pdev->bus, pdev->dev, pdev->func);
+
+		pci_device_get_names(pdev, &cname, &vname, &dname);
 
-		if (!verbose) {
-			xo_emit("{k:vendorid/%04x}:{k:deviceid/%04x} {k:subvendorid/%04x}:{k:subdeviceid/%04x}\n",
-					pdev->vendor_id, pdev->device_id,
-					pdev->subvendor_id, pdev->subdevice_id);
-		} else {
-			const char *cname = NULL, *vname = NULL, *dname = NULL;
+		xo_emit("{k:classname} {k:vendorname} {k:devname}\n", cname, vname, dname);
+	}
+
+	if (show_bars)
+		bars_emit(pdev, (depth + 1) * 4);
+
+	if (show_throughput)
+		throughput_emit(pdev, (depth + 1) * 4);
+}
+
+/**
+ * Print a device and, unless the depth limit is reached, the buses below it
+ */
+static void
+print_device(struct pci_device *pdev, uint32_t depth, int verbose, int expand)
+{
+	const struct pci_bridge_info *binfo = NULL;
+
+	xo_open_instance("device");
 
-			cname = pci_device_get_class_name(pdev);
-			vname = pci_device_get_vendor_name(pdev);
-			dname = pci_device_get_device_name(pdev);
+	print_device_line(pdev, depth, verbose);
 
-			xo_emit("{k:classname} {k:vendorname} {k:devname}\n", cname, vname, dname);
+	if (!expand)
+		sriov_emit_vfs(pdev, (depth + 1) * 4, verbose);
+
+	binfo = pci_device_get_bridge_info(pdev);
+	if ((binfo != NULL) && (binfo->secondary_bus > 0) &&
+			((max_depth == 0) || (depth < max_depth))) {
+		struct bus_s *sb = get_bus(&buses, binfo->secondary_bus);
+
+		if (sb != NULL) {
+			xo_open_list("bus");
+			print_bus_tree(sb, depth + 1, verbose, expand);
+			xo_close_list("bus");
 		}
+	}
 
-		const struct pci_bridge_info *binfo = NULL;
+	xo_close_instance("device");
+}
 
-		binfo = pci_device_get_bridge_info(pdev);
-		if ((binfo != NULL) && (binfo->secondary_bus > 0)) {
-			struct bus_s *sb = get_bus(&buses, binfo->secondary_bus);
+static void
+print_bus_tree(struct bus_s *b, uint32_t depth, int verbose, int expand)
+{
+	struct pdev_s *d = NULL;
+
+	print_bus_open(b->parent ? b->parent->domain : 0, b->bus, depth);
+
+	STAILQ_FOREACH(d, &b->devices, entries) {
+		if (!expand && (sriov_vf_parent(d->dev) != NULL))
+			continue;
+
+		print_device(d->dev, depth, verbose, expand);
+	}
 
-			if (sb != NULL) {
-				xo_open_list("bus");
-				print_bus_tree(sb, depth + 1, verbose);
-				xo_close_list("bus");
+	print_bus_close();
+}
+
+/**
+ * Print a device and the hierarchy below it
+ *
+ * Only the buses the device forwards to (if it is a bridge) are
+ * enumerated, along with its own bus to find its VFs.
+ */
+static void
+print_subtree(struct pci_device *pdev, int verbose, int expand)
+{
+	const struct pci_bridge_info *binfo;
+	struct pci_slot_match match;
+	uint32_t bus;
+
+	tree_build_range(pdev);
+
+	if (!expand) {
+		match.domain = pdev->domain;
+		match.bus = pdev->bus;
+		match.dev = PCI_MATCH_ANY;
+		match.func = PCI_MATCH_ANY;
+		match.match_data = 0;
+
+		sriov_scan(&match);
+
+		binfo = pci_device_get_bridge_info(pdev);
+		if ((binfo != NULL) && (binfo->secondary_bus != 0)) {
+			for (bus = binfo->secondary_bus;
+					bus <= binfo->subordinate_bus; bus++) {
+				match.bus = bus;
+				sriov_scan(&match);
 			}
 		}
+	}
+
+	print_bus_open(pdev->domain, pdev->bus, 1);
+	print_device(pdev, 1, verbose, expand);
+	print_bus_close();
+}
+
+static void
+print_chain(struct pci_device **chain, uint32_t i, uint32_t depth, int verbose)
+{
+	struct pci_device *pdev = chain[i];
 
-		xo_close_instance("device");
+	print_bus_open(pdev->domain, pdev->bus, depth);
+	xo_open_instance("device");
+
+	print_device_line(pdev, depth, verbose);
+
+	if (i > 0) {
+		xo_open_list("bus");
+		print_chain(chain, i - 1, depth + 1, verbose);
+		xo_close_list("bus");
 	}
 
-	xo_close_list("device");
+	xo_close_instance("device");
+	print_bus_close();
+}
 
-	xo_close_instance("bus");
+/**
+ * Print the bridges between a device and its host bus
+ *
+ * Only PCI-to-PCI bridges are examined to find the parent of each bus.
+ */
+static void
+print_ancestors(struct pci_device *pdev, int verbose)
+{
+	struct pci_device_iterator *iter;
+	struct pci_device **bridges = NULL, **p, *dev;
+	struct pci_device *chain[MAX_BUS_DEPTH];
+	uint32_t nbridges = 0, n = 0, i;
+
+	stats_begin(STATS_TOPOLOGY);
+
+	iter = pci_slot_match_iterator_create(NULL);
+	while ((dev = stats_device_next(iter)) != NULL) {
+		if ((dev->device_class >> 8) != PCI_CLASS_BRIDGE_PCI)
+			continue;
+
+		p = realloc(bridges, (nbridges + 1) * sizeof(*bridges));
+		if (p == NULL)
+			break;
+		bridges = p;
+		bridges[nbridges++] = dev;
+	}
+	pci_iterator_destroy(iter);
+
+	chain[n++] = pdev;
+	while (n < MAX_BUS_DEPTH) {
+		dev = chain[n - 1];
+
+		for (i = 0; i < nbridges; i++) {
+			const struct pci_bridge_info *binfo;
+
+			if ((bridges[i] == dev) || (bridges[i]->domain != dev->domain))
+				continue;
+
+			binfo = pci_device_get_bridge_info(bridges[i]);
+			if ((binfo != NULL) && (binfo->secondary_bus != 0) &&
+					(binfo->secondary_bus == dev->bus))
+				break;
+		}
+
+		if (i == nbridges)
+			break;
+
+		chain[n++] = bridges[i];
+	}
+
+	stats_end(STATS_TOPOLOGY);
+
+	print_chain(chain, n - 1, 1, verbose);
+
+	free(bridges);
 }
 
 static void
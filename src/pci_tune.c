@@ -0,0 +1,533 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+#include <getopt.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+#include <sys/queue.h>
+
+#include "pci_cap.h"
+
+extern void usage(void);
+extern struct pci_slot_match *parse_selector(const char *s);
+extern void tree_build(void);
+extern struct pci_device *tree_parent(const struct pci_device *pdev);
+extern void tree_free(void);
+extern void sriov_scan(const struct pci_slot_match *match);
+extern struct pci_device *sriov_vf_parent(const struct pci_device *pdev);
+extern void sriov_free(void);
+
+#define TUNE_UNSET	-1
+#define MPS_MIN		128U
+#define MPS_MAX		4096U
+
+static struct option opts[] = {
+	{ "dry-run", no_argument, NULL, 'n'},
+	{ NULL, 0, NULL, 0 }
+};
+
+/* Settings requested by a profile. TUNE_UNSET leaves a setting unchanged */
+struct tune_set {
+	int32_t mps;
+	int32_t mrrs;
+	int32_t ro;
+	int32_t ext_tags;
+	int32_t tags10;
+};
+
+/*
+ * A profile rule matches devices either by (partial) class code or by
+ * selector and applies its settings to them. Later rules override earlier
+ * ones.
+ */
+struct tune_rule {
+	uint32_t class;
+	uint32_t class_mask;
+	struct pci_slot_match *pmatch;
+	struct tune_set set;
+	STAILQ_ENTRY(tune_rule) entries;
+};
+
+STAILQ_HEAD(tune_rule_list_s, tune_rule);
+
+struct tune_dev {
+	struct pci_device *pdev;
+	struct pci_device *root;	/* top of the device's hierarchy */
+	uint32_t depth;
+	uint32_t cap;
+	uint32_t devcap;
+	uint32_t devcap2;
+	uint16_t devctl;
+	uint16_t devctl2;
+	uint16_t new_devctl;
+	uint16_t new_devctl2;
+	struct tune_set set;
+};
+
+static int32_t
+parse_size(const char *v, int32_t max_ok)
+{
+	char *v_end = NULL;
+	uint32_t sz;
+
+	if (max_ok && (strcmp(v, "max") == 0)) {
+		return MPS_MAX;
+	}
+
+	sz = strtoul(v, &v_end, 0);
+	if ((*v_end != '\0') || (sz < MPS_MIN) || (sz > MPS_MAX) ||
+			(sz & (sz - 1))) {
+		return TUNE_UNSET;
+	}
+
+	return sz;
+}
+
+static int32_t
+parse_bool(const char *v)
+{
+
+	if ((strcmp(v, "on") == 0) || (strcmp(v, "1") == 0)) {
+		return 1;
+	} else if ((strcmp(v, "off") == 0) || (strcmp(v, "0") == 0)) {
+		return 0;
+	}
+
+	return TUNE_UNSET;
+}
+
+/**
+ * Parse a single "key=value" setting into the rule
+ */
+static int32_t
+parse_setting(struct tune_set *set, char *kv)
+{
+	char *v = strchr(kv, '=');
+	int32_t rc = -1;
+
+	if (v == NULL) {
+		return -1;
+	}
+	*v++ = '\0';
+
+	if (strcasecmp(kv, "mps") == 0) {
+		set->mps = parse_size(v, 1);
+		rc = set->mps == TUNE_UNSET ? -1 : 0;
+	} else if (strcasecmp(kv, "mrrs") == 0) {
+		set->mrrs = parse_size(v, 0);
+		rc = set->mrrs == TUNE_UNSET ? -1 : 0;
+	} else if (strcasecmp(kv, "ro") == 0) {
+		set->ro = parse_bool(v);
+		rc = set->ro == TUNE_UNSET ? -1 : 0;
+	} else if (strcasecmp(kv, "exttags") == 0) {
+		set->ext_tags = parse_bool(v);
+		rc = set->ext_tags == TUNE_UNSET ? -1 : 0;
+	} else if (strcasecmp(kv, "tags10") == 0) {
+		set->tags10 = parse_bool(v);
+		rc = set->tags10 == TUNE_UNSET ? -1 : 0;
+	}
+
+	/* Leave the setting whole for error messages */
+	v[-1] = '=';
+
+	return rc;
+}
+
+/**
+ * Read a tuning profile
+ *
+ * Each non-comment line of a profile contains a match followed by one or
+ * more settings:
+ *   <match> <key>=<value> ...
+ *
+ * where match is one of
+ *   *              all devices
+ *   class:<code>   class code prefix of 2, 4, or 6 hex digits (e.g. 0108)
+ *   <selector>     devices matching the selector
+ *
+ * Exits on a syntax error, giving the line it was found on.
+ */
+static void
+parse_profile(const char *path, struct tune_rule_list_s *rules)
+{
+	char line[256];
+	uint32_t lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		err(1, "Couldn't read profile %s", path);
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct tune_rule *r;
+		char *tok, *save = NULL, *c;
+
+		lineno++;
+
+		c = strchr(line, '#');
+		if (c != NULL)
+			*c = '\0';
+
+		tok = strtok_r(line, " \t\n", &save);
+		if (tok == NULL)
+			continue;
+
+		r = calloc(1, sizeof(struct tune_rule));
+		if (r == NULL)
+			err(1, "tune");
+
+		r->set.mps = r->set.mrrs = r->set.ro = TUNE_UNSET;
+		r->set.ext_tags = r->set.tags10 = TUNE_UNSET;
+
+		if (strcmp(tok, "*") == 0) {
+			r->class_mask = 0;
+		} else if (strncmp(tok, "class:", 6) == 0) {
+			size_t len = strlen(tok + 6);
+
+			if ((len != 2) && (len != 4) && (len != 6)) {
+				errx(1, "%s:%u: bad class '%s'", path, lineno, tok + 6);
+			}
+
+			r->class = strtoul(tok + 6, NULL, 16) << ((6 - len) * 4);
+			r->class_mask = 0xffffff & ~((1 << ((6 - len) * 4)) - 1);
+		} else {
+			r->pmatch = parse_selector(tok);
+			if (r->pmatch == NULL) {
+				errx(1, "%s:%u: bad match '%s'", path, lineno, tok);
+			}
+		}
+
+		while ((tok = strtok_r(NULL, " \t\n", &save)) != NULL) {
+			if (parse_setting(&r->set, tok)) {
+				errx(1, "%s:%u: bad setting '%s'", path, lineno, tok);
+			}
+		}
+
+		STAILQ_INSERT_TAIL(rules, r, entries);
+	}
+
+	if (ferror(f)) {
+		err(1, "Couldn't read profile %s", path);
+	}
+
+	fclose(f);
+}
+
+#define MATCH(m, v)	(((m) == PCI_MATCH_ANY) || ((m) == (v)))
+
+static int
+rule_match(const struct tune_rule *r, const struct pci_device *pdev)
+{
+
+	if (r->pmatch != NULL) {
+		return MATCH(r->pmatch->domain, pdev->domain) &&
+			MATCH(r->pmatch->bus, pdev->bus) &&
+			MATCH(r->pmatch->dev, pdev->dev) &&
+			MATCH(r->pmatch->func, pdev->func);
+	}
+
+	return (pdev->device_class & r->class_mask) == r->class;
+}
+
+static void
+merge_set(struct tune_set *to, const struct tune_set *from)
+{
+
+	if (from->mps != TUNE_UNSET)
+		to->mps = from->mps;
+	if (from->mrrs != TUNE_UNSET)
+		to->mrrs = from->mrrs;
+	if (from->ro != TUNE_UNSET)
+		to->ro = from->ro;
+	if (from->ext_tags != TUNE_UNSET)
+		to->ext_tags = from->ext_tags;
+	if (from->tags10 != TUNE_UNSET)
+		to->tags10 = from->tags10;
+}
+
+static uint16_t
+size_encode(uint32_t sz)
+{
+	uint16_t e = 0;
+
+	while ((MPS_MIN << e) < sz)
+		e++;
+
+	return e;
+}
+
+/**
+ * Can every port between the device and the root complex complete
+ * requests using 10-bit tags?
+ */
+static int
+path_10bit_completer(struct pci_device *pdev)
+{
+	struct pci_device *p;
+
+	for (p = tree_parent(pdev); p != NULL; p = tree_parent(p)) {
+		uint32_t cap, devcap2 = 0;
+
+		cap = pci_find_cap(p, PCI_CAP_ID_EXP);
+		if ((cap == 0) || read_cfg(p, cap + PCIE_DEVCAP2, &devcap2, 4) ||
+				!(devcap2 & PCIE_DEVCAP2_10BIT_TAG_COMP)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Compute the register values implied by the profile
+ *
+ * Max Payload Size must be the same for every function in a hierarchy
+ * below a root port, so it is set to the smallest of the requested sizes
+ * and the sizes supported (DEVCAP) by each function in the hierarchy.
+ */
+static void
+tune_compute(struct tune_dev *td, uint32_t ndev)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < ndev; i++) {
+		struct tune_dev *t = &td[i];
+		uint32_t mps = MPS_MAX;
+		int requested = 0;
+
+		t->new_devctl = t->devctl;
+		t->new_devctl2 = t->devctl2;
+
+		for (j = 0; j < ndev; j++) {
+			if (td[j].root != t->root)
+				continue;
+
+			if (td[j].set.mps != TUNE_UNSET) {
+				requested = 1;
+				if ((uint32_t)td[j].set.mps < mps)
+					mps = td[j].set.mps;
+			}
+
+			if ((MPS_MIN << PCIE_DEVCAP_MPSS(td[j].devcap)) < mps)
+				mps = MPS_MIN << PCIE_DEVCAP_MPSS(td[j].devcap);
+		}
+
+		if (requested) {
+			t->new_devctl &= ~PCIE_DEVCTL_MPS;
+			t->new_devctl |= size_encode(mps) << PCIE_DEVCTL_MPS_SHIFT;
+		}
+
+		if (t->set.mrrs != TUNE_UNSET) {
+			t->new_devctl &= ~PCIE_DEVCTL_MRRS;
+			t->new_devctl |= size_encode(t->set.mrrs) << PCIE_DEVCTL_MRRS_SHIFT;
+		}
+
+		if (t->set.ro == 1)
+			t->new_devctl |= PCIE_DEVCTL_RO;
+		else if (t->set.ro == 0)
+			t->new_devctl &= ~PCIE_DEVCTL_RO;
+
+		if ((t->set.ext_tags == 1) && (t->devcap & PCIE_DEVCAP_EXT_TAG))
+			t->new_devctl |= PCIE_DEVCTL_EXT_TAG;
+		else if (t->set.ext_tags == 0)
+			t->new_devctl &= ~PCIE_DEVCTL_EXT_TAG;
+
+		if ((t->set.tags10 == 1) &&
+				(t->devcap2 & PCIE_DEVCAP2_10BIT_TAG_REQ) &&
+				path_10bit_completer(t->pdev))
+			t->new_devctl2 |= PCIE_DEVCTL2_10BIT_TAG_REQ;
+		else if (t->set.tags10 == 0)
+			t->new_devctl2 &= ~PCIE_DEVCTL2_10BIT_TAG_REQ;
+	}
+}
+
+/* Order devices from the root complex down */
+static int
+tune_dev_cmp(const void *a, const void *b)
+{
+	const struct tune_dev *ta = a, *tb = b;
+
+	if (ta->depth != tb->depth)
+		return ta->depth < tb->depth ? -1 : 1;
+	if (ta->pdev->bus != tb->pdev->bus)
+		return ta->pdev->bus < tb->pdev->bus ? -1 : 1;
+	if (ta->pdev->dev != tb->pdev->dev)
+		return ta->pdev->dev < tb->pdev->dev ? -1 : 1;
+
+	return ta->pdev->func - tb->pdev->func;
+}
+
+/**
+ * Show (and optionally write) a register which differs from the profile
+ */
+static uint32_t
+tune_reg(struct tune_dev *t, const char *name, uint32_t off, uint16_t old,
+		uint16_t new, int write)
+{
+	struct pci_device *pdev = t->pdev;
+	uint16_t v = 0;
+
+	if (old == new)
+		return 0;
+
+	xo_open_instance("register");
+	xo_emit("{k:bdf/%04x:%02x:%02x.%u} {k:register/%s} {:old/0x%04x} -> {:new/0x%04x}",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func,
+			name, old, new);
+
+	if (write) {
+		if (write_cfg(pdev, t->cap + off, &new, 2) ||
+				read_cfg(pdev, t->cap + off, &v, 2) || (v != new)) {
+			xo_emit(" {:status/failed}");
+		} else {
+			xo_emit(" {:status/ok}");
+		}
+	}
+
+	xo_emit("\n");
+	xo_close_instance("register");
+
+	return 1;
+}
+
+/**
+ * Apply or check performance tuning settings described by a profile
+ */
+void
+tune(int argc, char *argv[])
+{
+	struct tune_rule_list_s rules = STAILQ_HEAD_INITIALIZER(rules);
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct tune_rule *r, *rn;
+	struct tune_dev *td = NULL;
+	uint32_t ndev = 0, i, changes = 0;
+	int ch, dry_run = 0, apply;
+
+	while ((ch = getopt_long(argc, argv, "n", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			return;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ((argc < 2) || ((strcmp(argv[0], "apply") != 0) &&
+				(strcmp(argv[0], "check") != 0))) {
+		usage();
+		return;
+	}
+
+	apply = (strcmp(argv[0], "apply") == 0) && !dry_run;
+
+	parse_profile(argv[1], &rules);
+
+	tree_build();
+	sriov_scan(NULL);
+
+	iter = pci_slot_match_iterator_create(NULL);
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		struct tune_dev *t;
+		struct pci_device *p;
+		uint32_t cap;
+
+		/* VF Device Control fields are RsvdP, VFs use their PF's */
+		if (sriov_vf_parent(pdev) != NULL)
+			continue;
+
+		cap = pci_find_cap(pdev, PCI_CAP_ID_EXP);
+		if (cap == 0)
+			continue;
+
+		t = realloc(td, (ndev + 1) * sizeof(struct tune_dev));
+		if (t == NULL)
+			err(1, "tune");
+		td = t;
+		t = &td[ndev++];
+
+		memset(t, 0, sizeof(struct tune_dev));
+		t->pdev = pdev;
+		t->cap = cap;
+		t->root = pdev;
+		for (p = tree_parent(pdev); p != NULL; p = tree_parent(p)) {
+			t->root = p;
+			t->depth++;
+		}
+
+		read_cfg(pdev, cap + PCIE_DEVCAP, &t->devcap, 4);
+		read_cfg(pdev, cap + PCIE_DEVCTL, &t->devctl, 2);
+		read_cfg(pdev, cap + PCIE_DEVCAP2, &t->devcap2, 4);
+		read_cfg(pdev, cap + PCIE_DEVCTL2, &t->devctl2, 2);
+
+		t->set.mps = t->set.mrrs = t->set.ro = TUNE_UNSET;
+		t->set.ext_tags = t->set.tags10 = TUNE_UNSET;
+
+		STAILQ_FOREACH(r, &rules, entries) {
+			if (rule_match(r, pdev))
+				merge_set(&t->set, &r->set);
+		}
+	}
+	pci_iterator_destroy(iter);
+
+	tune_compute(td, ndev);
+
+	qsort(td, ndev, sizeof(struct tune_dev), tune_dev_cmp);
+
+	xo_open_list("register");
+	for (i = 0; i < ndev; i++) {
+		changes += tune_reg(&td[i], "DEVCTL", PCIE_DEVCTL,
+				td[i].devctl, td[i].new_devctl, apply);
+		changes += tune_reg(&td[i], "DEVCTL2", PCIE_DEVCTL2,
+				td[i].devctl2, td[i].new_devctl2, apply);
+	}
+	xo_close_list("register");
+
+	xo_emit("{:changes/%u} register(s) {d:/%s}\n", changes,
+			apply ? "written" : "differ from the profile");
+
+	free(td);
+	sriov_free();
+	tree_free();
+
+	r = STAILQ_FIRST(&rules);
+	while (r != NULL) {
+		rn = STAILQ_NEXT(r, entries);
+		free(r->pmatch);
+		free(r);
+		r = rn;
+	}
+}
@@ -0,0 +1,619 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Vital Product Data (VPD) reader
+ *
+ * Each dword of VPD is read by writing its address to the VPD capability
+ * and polling for the device to set the completion flag, which can take
+ * milliseconds. Devices are read concurrently, only as much VPD as is
+ * needed to find the requested keywords is read, and results are cached
+ * keyed by the device's location, IDs, and Device Serial Number. Devices
+ * without a serial number are always read, as a replacement card of the
+ * same model in the same slot would otherwise match the old card's entry.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libxo/xo.h>
+#include <pciaccess.h>
+
+#include "pci_cap.h"
+
+extern struct pci_slot_match *parse_selector(const char *s);
+extern uint32_t work_default_threads(void);
+extern void work_run(uint32_t n, uint32_t nthreads,
+		void (*fn)(void *arg, uint32_t idx), void *arg);
+
+#define SYSFS_PCI_DEVICES	"/sys/bus/pci/devices"
+#define VPD_CACHE_PATH		"/var/cache/pci-vpd.cache"
+
+/* Devices may take several ms per dword, the spec sets no limit */
+#define VPD_TIMEOUT_NS		(100 * 1000000ULL)
+#define VPD_POLL_MIN_US		10
+#define VPD_POLL_MAX_US		1000
+
+/* Resource data type tags */
+#define VPD_TAG_LARGE		0x80
+#define VPD_TAG_ID_STRING	0x02
+#define VPD_TAG_VPD_R		0x10
+#define VPD_TAG_END		0x0f
+#define VPD_SMALL_NAME(t)	(((t) >> 3) & 0xf)
+#define VPD_SMALL_LEN(t)	((t) & 0x7)
+
+#define VPD_STR_LEN		128
+
+enum vpd_field {
+	VPD_NAME,
+	VPD_PN,
+	VPD_SN,
+	VPD_EC,
+	VPD_MN,
+	VPD_NFIELDS
+};
+
+/* VPD-R keywords of the fields after the identifier string */
+static const char *vpd_keyword[VPD_NFIELDS] = { NULL, "PN", "SN", "EC", "MN" };
+
+static struct option opts[] = {
+	{ "cache", required_argument, NULL, 'c'},
+	{ "jobs", required_argument, NULL, 'j'},
+	{ "refresh", no_argument, NULL, 'r'},
+	{ "selector", required_argument, NULL, 's'},
+	{ NULL, 0, NULL, 0 }
+};
+
+struct vpd_dev {
+	struct pci_device *pdev;
+	uint64_t dsn;
+	uint32_t cap;
+	const char *source;	/* "cache", "sysfs", or "capability" */
+	int32_t rc;
+	uint64_t read_ns;
+	char field[VPD_NFIELDS][VPD_STR_LEN];
+};
+
+/* Where a device's VPD is read from and the last dword read */
+struct vpd_src {
+	struct pci_device *pdev;
+	uint32_t cap;
+	int fd;
+	int32_t addr;
+	uint32_t data;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Read one dword through the VPD capability
+ */
+static int32_t
+vpd_read_dword(struct vpd_src *src, uint32_t addr, uint32_t *data)
+{
+	uint64_t deadline;
+	uint32_t sleep_us = VPD_POLL_MIN_US;
+	uint16_t a = addr & VPD_ADDR_MASK;
+	int32_t rc;
+
+	rc = write_cfg(src->pdev, src->cap + VPD_ADDR, &a, 2);
+	if (rc)
+		return rc;
+
+	deadline = now_ns() + VPD_TIMEOUT_NS;
+
+	for (;;) {
+		rc = read_cfg(src->pdev, src->cap + VPD_ADDR, &a, 2);
+		if (rc)
+			return rc;
+
+		if (a & VPD_ADDR_F)
+			break;
+
+		if (now_ns() > deadline)
+			return ETIMEDOUT;
+
+		usleep(sleep_us);
+		if (sleep_us < VPD_POLL_MAX_US)
+			sleep_us *= 2;
+	}
+
+	return read_cfg(src->pdev, src->cap + VPD_DATA, data, 4);
+}
+
+static int32_t
+vpd_read(struct vpd_src *src, uint32_t off, void *buf, uint32_t len)
+{
+	uint8_t *b = buf;
+	uint32_t i;
+	int32_t rc;
+
+	if (off + len > VPD_MAX_SIZE)
+		return EINVAL;
+
+	if (src->fd >= 0) {
+		ssize_t n = pread(src->fd, buf, len, off);
+
+		if (n < 0)
+			return errno;
+
+		return (uint32_t)n == len ? 0 : EIO;
+	}
+
+	for (i = 0; i < len; i++) {
+		uint32_t addr = (off + i) & ~3;
+
+		if (src->addr != (int32_t)addr) {
+			rc = vpd_read_dword(src, addr, &src->data);
+			if (rc) {
+				src->addr = -1;
+				return rc;
+			}
+			src->addr = addr;
+		}
+
+		b[i] = src->data >> (((off + i) & 3) * 8);
+	}
+
+	return 0;
+}
+
+/**
+ * Copy a VPD string, replacing anything that isn't printable and
+ * dropping trailing padding
+ */
+static void
+vpd_str(char *dst, const uint8_t *src, uint32_t len)
+{
+	uint32_t i;
+
+	if (len >= VPD_STR_LEN)
+		len = VPD_STR_LEN - 1;
+
+	for (i = 0; (i < len) && (src[i] != '\0'); i++)
+		dst[i] = ((src[i] >= 0x20) && (src[i] < 0x7f)) ? src[i] : '.';
+
+	while ((i > 0) && (dst[i - 1] == ' '))
+		i--;
+
+	dst[i] = '\0';
+}
+
+/**
+ * Find the wanted keywords in the VPD-R resource
+ *
+ * Returns the number of fields found
+ */
+static uint32_t
+vpd_parse_r(struct vpd_src *src, uint32_t off, uint32_t len, struct vpd_dev *v,
+		int32_t *rc)
+{
+	uint8_t kw[3], data[255];
+	uint32_t end = off + len, found = 0;
+	enum vpd_field f;
+
+	while ((off + sizeof(kw) <= end) && (found < VPD_NFIELDS - 1)) {
+		*rc = vpd_read(src, off, kw, sizeof(kw));
+		if (*rc)
+			break;
+
+		off += sizeof(kw);
+
+		for (f = VPD_PN; f < VPD_NFIELDS; f++) {
+			if (memcmp(kw, vpd_keyword[f], 2) == 0)
+				break;
+		}
+
+		/* Only read the data of wanted keywords */
+		if (f < VPD_NFIELDS) {
+			*rc = vpd_read(src, off, data, kw[2]);
+			if (*rc)
+				break;
+			vpd_str(v->field[f], data, kw[2]);
+			found++;
+		}
+
+		off += kw[2];
+	}
+
+	return found;
+}
+
+/**
+ * Walk the VPD resources, stopping once the identifier string and all
+ * keywords have been found
+ */
+static int32_t
+vpd_parse(struct vpd_src *src, struct vpd_dev *v)
+{
+	uint8_t tag, hdr[2], data[VPD_STR_LEN];
+	uint32_t off = 0, len, found = 0;
+	int32_t rc = 0;
+
+	while (off < VPD_MAX_SIZE) {
+		rc = vpd_read(src, off, &tag, 1);
+		if (rc)
+			break;
+
+		if ((off == 0) && ((tag == 0x00) || (tag == 0xff)))
+			return ENOENT;
+
+		if (!(tag & VPD_TAG_LARGE)) {
+			if (VPD_SMALL_NAME(tag) == VPD_TAG_END)
+				break;
+			off += 1 + VPD_SMALL_LEN(tag);
+			continue;
+		}
+
+		rc = vpd_read(src, off + 1, hdr, sizeof(hdr));
+		if (rc)
+			break;
+
+		len = hdr[0] | (hdr[1] << 8);
+		off += 3;
+
+		switch (tag & ~VPD_TAG_LARGE) {
+		case VPD_TAG_ID_STRING:
+			rc = vpd_read(src, off,
+					data, len < sizeof(data) ? len : sizeof(data));
+			if (rc)
+				return rc;
+			vpd_str(v->field[VPD_NAME], data,
+					len < sizeof(data) ? len : sizeof(data));
+			found++;
+			break;
+		case VPD_TAG_VPD_R:
+			found += vpd_parse_r(src, off, len, v, &rc);
+			if (rc)
+				return rc;
+			break;
+		default:
+			break;
+		}
+
+		if (found == VPD_NFIELDS)
+			break;
+
+		off += len;
+	}
+
+	return rc;
+}
+
+/**
+ * Worker reading the VPD of one device, preferring the kernel's sysfs
+ * interface which serializes with any driver access
+ */
+static void
+vpd_read_dev(void *arg, uint32_t idx)
+{
+	struct vpd_dev *v = &((struct vpd_dev *)arg)[idx];
+	struct pci_device *pdev = v->pdev;
+	struct vpd_src src = { pdev, v->cap, -1, -1, 0 };
+	char path[128];
+	uint64_t start;
+
+	if (v->source != NULL)
+		return;
+
+	snprintf(path, sizeof(path), SYSFS_PCI_DEVICES "/%04x:%02x:%02x.%u/vpd",
+			pdev->domain, pdev->bus, pdev->dev, pdev->func);
+	src.fd = open(path, O_RDONLY);
+	v->source = src.fd >= 0 ? "sysfs" : "capability";
+
+	start = now_ns();
+	v->rc = vpd_parse(&src, v);
+	v->read_ns = now_ns() - start;
+
+	if (src.fd >= 0)
+		close(src.fd);
+}
+
+/**
+ * Load cached VPD for devices which still match their cache entry
+ *
+ * Entries are "<bdf> <dsn> <vendor>:<device>:<subvendor>:<subdevice>"
+ * followed by tab separated fields.
+ */
+static void
+vpd_cache_load(const char *path, struct vpd_dev *devs, uint32_t ndevs)
+{
+	char line[VPD_NFIELDS * VPD_STR_LEN + 64];
+	FILE *f;
+
+	struct stat sb;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return;
+
+	/* Only trust a cache nobody else could have written */
+	if (fstat(fileno(f), &sb) || (sb.st_uid != geteuid()) ||
+			(sb.st_mode & (S_IWGRP | S_IWOTH))) {
+		xo_warnx("%s: ignoring cache not owned by this user or writable by others",
+				path);
+		fclose(f);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned int dom, bus, dev, func, vid, did, svid, sdid;
+		uintmax_t dsn;
+		char *p, *tab;
+		uint32_t i;
+		enum vpd_field fld;
+
+		if ((sscanf(line, "%x:%x:%x.%u %jx %x:%x:%x:%x", &dom, &bus, &dev,
+				&func, &dsn, &vid, &did, &svid, &sdid) != 9) ||
+				(dsn == 0))
+			continue;
+
+		for (i = 0; i < ndevs; i++) {
+			struct pci_device *pdev = devs[i].pdev;
+
+			if ((pdev->domain == dom) && (pdev->bus == bus) &&
+					(pdev->dev == dev) && (pdev->func == func) &&
+					(devs[i].dsn == dsn) &&
+					(pdev->vendor_id == vid) && (pdev->device_id == did) &&
+					(pdev->subvendor_id == svid) &&
+					(pdev->subdevice_id == sdid))
+				break;
+		}
+
+		if (i == ndevs)
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		p = strchr(line, '\t');
+
+		for (fld = VPD_NAME; (fld < VPD_NFIELDS) && (p != NULL); fld++) {
+			p++;
+			tab = strchr(p, '\t');
+			if (tab != NULL)
+				*tab = '\0';
+			snprintf(devs[i].field[fld], VPD_STR_LEN, "%s", p);
+			p = tab;
+		}
+
+		devs[i].source = "cache";
+	}
+
+	fclose(f);
+}
+
+/**
+ * Write the cache, keeping entries for devices which weren't read
+ */
+static void
+vpd_cache_save(const char *path, struct vpd_dev *devs, uint32_t ndevs)
+{
+	char line[VPD_NFIELDS * VPD_STR_LEN + 64], tmp[256];
+	FILE *in, *out;
+	uint32_t i;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		xo_warn("%s", tmp);
+		return;
+	}
+
+	out = fdopen(fd, "w");
+	if (out == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	in = fopen(path, "r");
+	if (in != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			unsigned int dom, bus, dev, func;
+
+			if (sscanf(line, "%x:%x:%x.%u", &dom, &bus, &dev, &func) != 4)
+				continue;
+
+			for (i = 0; i < ndevs; i++) {
+				struct pci_device *pdev = devs[i].pdev;
+
+				if ((pdev->domain == dom) && (pdev->bus == bus) &&
+						(pdev->dev == dev) && (pdev->func == func))
+					break;
+			}
+
+			if (i == ndevs)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		struct pci_device *pdev = devs[i].pdev;
+		enum vpd_field fld;
+
+		if (devs[i].rc || (devs[i].dsn == 0))
+			continue;
+
+		fprintf(out, "%04x:%02x:%02x.%u %016jx %04x:%04x:%04x:%04x",
+				pdev->domain, pdev->bus, pdev->dev, pdev->func,
+				(uintmax_t)devs[i].dsn, pdev->vendor_id, pdev->device_id,
+				pdev->subvendor_id, pdev->subdevice_id);
+		for (fld = VPD_NAME; fld < VPD_NFIELDS; fld++)
+			fprintf(out, "\t%s", devs[i].field[fld]);
+		fprintf(out, "\n");
+	}
+
+	if (fclose(out) || rename(tmp, path)) {
+		xo_warn("%s", path);
+		unlink(tmp);
+	}
+}
+
+static const char *
+vpd_field(const struct vpd_dev *v, enum vpd_field f)
+{
+
+	return v->field[f][0] ? v->field[f] : "-";
+}
+
+/**
+ * Read the part number, serial number, and EC level of devices
+ * implementing VPD
+ */
+void
+vpd(int argc, char *argv[])
+{
+	struct pci_device_iterator *iter = NULL;
+	struct pci_device *pdev = NULL;
+	struct pci_slot_match *pmatch = NULL;
+	struct vpd_dev *devs = NULL, *v;
+	const char *sel_str = NULL, *cache = VPD_CACHE_PATH;
+	uint32_t ndevs = 0, nthreads = 0, i, nread = 0;
+	int ch, refresh = 0;
+
+	while ((ch = getopt_long(argc, argv, "c:j:rs:", opts, NULL)) != -1) {
+		switch (ch) {
+		case 'c':
+			cache = optarg;
+			break;
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			refresh = 1;
+			break;
+		case 's':
+			sel_str = optarg;
+			break;
+		default:
+			return;
+		}
+	}
+
+	if (sel_str != NULL) {
+		pmatch = parse_selector(sel_str);
+		if (pmatch == NULL)
+			return;
+	}
+
+	/* The threads mostly sleep waiting on devices */
+	if (nthreads == 0)
+		nthreads = 4 * work_default_threads();
+
+	iter = pci_slot_match_iterator_create(pmatch);
+
+	while ((pdev = pci_device_next(iter)) != NULL) {
+		uint32_t cap, lo = 0, hi = 0, ext;
+
+		cap = pci_find_cap(pdev, PCI_CAP_ID_VPD);
+		if (cap == 0)
+			continue;
+
+		v = realloc(devs, (ndevs + 1) * sizeof(struct vpd_dev));
+		if (v == NULL) {
+			xo_warn("vpd");
+			break;
+		}
+		devs = v;
+		v = &devs[ndevs++];
+		memset(v, 0, sizeof(*v));
+
+		v->pdev = pdev;
+		v->cap = cap;
+
+		ext = pci_find_ext_cap(pdev, PCI_EXT_CAP_ID_DSN);
+		if (ext != 0) {
+			read_cfg(pdev, ext + DSN_LOW, &lo, 4);
+			read_cfg(pdev, ext + DSN_HIGH, &hi, 4);
+			v->dsn = ((uint64_t)hi << 32) | lo;
+		}
+	}
+
+	pci_iterator_destroy(iter);
+
+	if (!refresh && (cache[0] != '\0'))
+		vpd_cache_load(cache, devs, ndevs);
+
+	for (i = 0; i < ndevs; i++) {
+		if (devs[i].source == NULL)
+			nread++;
+	}
+
+	if (nread != 0)
+		work_run(ndevs, nthreads, vpd_read_dev, devs);
+
+	xo_open_list("device");
+
+	for (i = 0; i < ndevs; i++) {
+		v = &devs[i];
+		pdev = v->pdev;
+
+		xo_open_instance("device");
+
+		xo_emit("{k:bdf/%04x:%02x:%02x.%u} {:name}\n",
+				pdev->domain, pdev->bus, pdev->dev, pdev->func,
+				vpd_field(v, VPD_NAME));
+
+		if (v->rc) {
+			xo_emit("    {:error/%s} ({:source})\n", strerror(v->rc),
+					v->source);
+		} else {
+			xo_emit("    PN {:part-number} SN {:serial-number} EC {:ec-level} MN {:manufacturer} ({:source}",
+					vpd_field(v, VPD_PN), vpd_field(v, VPD_SN),
+					vpd_field(v, VPD_EC), vpd_field(v, VPD_MN),
+					v->source);
+			if (v->read_ns != 0)
+				xo_emit(" {:read-time/%ju}{U:us}",
+						(uintmax_t)(v->read_ns / 1000));
+			xo_emit(")\n");
+		}
+
+		xo_close_instance("device");
+	}
+
+	xo_close_list("device");
+
+	if ((nread != 0) && (cache[0] != '\0'))
+		vpd_cache_save(cache, devs, ndevs);
+
+	free(devs);
+	free(pmatch);
+}
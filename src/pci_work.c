@@ -0,0 +1,102 @@
+/*-
+ * Copyright (C) 2016 Chuck Tuffli
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Worker pool for per-device operations which spend most of their time
+ * waiting on hardware (e.g. polling a capability for completion)
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define WORK_MAX_THREADS	64
+
+struct work {
+	void (*fn)(void *arg, uint32_t idx);
+	void *arg;
+	uint32_t n;
+	uint32_t next;
+};
+
+static void *
+work_thread(void *arg)
+{
+	struct work *w = arg;
+	uint32_t idx;
+
+	while ((idx = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->n)
+		w->fn(w->arg, idx);
+
+	return NULL;
+}
+
+/**
+ * Return a default number of workers based on the online CPUs
+ */
+uint32_t
+work_default_threads(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu < 1)
+		ncpu = 1;
+
+	return ncpu > WORK_MAX_THREADS ? WORK_MAX_THREADS : ncpu;
+}
+
+/**
+ * Call fn(arg, idx) for each idx in [0, n) using up to nthreads threads
+ *
+ * Items are handed out in order as threads become free. Falls back to
+ * running the remaining items in the calling thread if threads cannot be
+ * created.
+ */
+void
+work_run(uint32_t n, uint32_t nthreads, void (*fn)(void *arg, uint32_t idx),
+		void *arg)
+{
+	pthread_t tid[WORK_MAX_THREADS];
+	struct work w = { fn, arg, n, 0 };
+	uint32_t i, started = 0;
+
+	if (nthreads > WORK_MAX_THREADS)
+		nthreads = WORK_MAX_THREADS;
+	if (nthreads > n)
+		nthreads = n;
+
+	for (i = 0; i + 1 < nthreads; i++) {
+		if (pthread_create(&tid[i], NULL, work_thread, &w) != 0)
+			break;
+		started++;
+	}
+
+	work_thread(&w);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+}